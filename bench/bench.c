@@ -0,0 +1,695 @@
+#include "bench_alloc.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+/**
+ * @brief classic multithreaded allocator workloads
+ *
+ * usage: ./bench_<alloc> <workload> [-t threads] [-n objects] [-i iterations]
+ *                                   [-s min_size] [-S max_size] [-r seed] [-e sample_every] [-z]
+ *                                   [-d defer_limit] [-H]
+ *
+ * workloads:
+ *   larson        every thread replaces random objects of its own set, after each round the
+ *                 sets move to the next thread, so objects are freed by other threads
+ *   threadtest    every thread mallocs objects of min_size, then frees all of them
+ *   cache-scratch every thread frees an object malloced by the first thread, then mallocs,
+ *                 writes and frees its own objects (passive false sharing)
+ *   cache-thrash  the same without the first object (active false sharing)
+ *   xmalloc       half of the threads malloc objects, the other half free them
+ *   random        every thread mallocs objects of random size, frees half of them, mallocs
+ *                 them again and frees all (the "N threads x K items" test)
+ *   churn         even threads malloc objects of min_size into empty random slots of a shared
+ *                 table, odd threads take them out and free them, so every object moves to
+ *                 another thread (fan-in). Every object is filled with a stamp kept in its slot,
+ *                 the run fails if an object taken out does not hold its stamp (given out twice)
+ *   batch         threadtest with objects malloced and freed BATCH_NUM at a time through the batch
+ *                 api (one call per object for allocators without it), latency is per object
+ *   chase         every thread mallocs its objects, links them into one cycle in random order and
+ *                 follows it iterations times, so every hop is a load from a random page of its heap.
+ *                 hop_ns is the mean time of a hop, dtlb_misses counts the dTLB read misses of the
+ *                 hops (-1 if the cpu counter cannot be read)
+ *   exit          every thread starts objects / threads short threads one after another, each mallocs
+ *                 and frees once, then keeps an object of min_size in a pthread key whose destructor
+ *                 frees it after the allocator cleaned up the thread. The run fails if the heap grows
+ *                 by the objects of the second half of the short threads (they were lost)
+ *
+ * objects is the number of objects of all threads, every run prints one JSON line:
+ *   ops (malloc + free) per second, sampled latency percentiles and the worst sampled op,
+ *   peak heap (data segment + mmap blocks), peak live bytes and fragmentation = peak heap /
+ *   peak live bytes. -e 1 times every op, so max_ns is the worst case of the run, -z frees every
+ *   object (but those of batch) with its size through bench_free_sized, -d turns on deferred
+ *   coalescing with at most defer_limit bytes waiting in the quick lists (of every thread).
+ *   search_steps counts the free blocks and tree nodes the mallocs of a plain version visit,
+ *   -H backs the heap of the thread versions by transparent huge pages, huge_bytes is the most of it
+ *   that was (read after the run and after the hops of chase)
+ */
+
+#define SAMPLE_EVERY 8 // time one op out of SAMPLE_EVERY by default
+#define MAX_SAMPLES (1 << 18) // latency samples per thread
+#define CHECK_EVERY 4096 // ops between two checks of the peak heap size
+#define CACHE_WRITES 64 // writes to each object in cache-scratch / cache-thrash
+#define LARSON_REPLACE 4 // replacements per object in every round of larson
+#define XMALLOC_BATCH 64 // objects passed from producer to consumer at once
+#define XMALLOC_QUEUE 64 // max batches waiting for consumers
+#define CHURN_PTR_BITS 48 // a slot of churn packs the object (low bits) and its 16-bit stamp
+#define BATCH_NUM 256 // objects of one call of batch
+
+typedef struct {
+  int threads;
+  size_t objects;
+  size_t iterations;
+  size_t min_size;
+  size_t max_size;
+  uint64_t seed;
+  size_t sample_every;
+  int sized; // free with the size
+  size_t defer; // limit of deferred coalescing, 0 is off
+  int huge; // transparent huge pages
+} Config;
+
+// state of one thread, on its own cache lines
+typedef struct {
+  int id;
+  uint64_t rng;
+  size_t ops;
+  atomic_long live; // bytes malloced - bytes freed by this thread, written by this thread only
+  size_t *lat;
+  size_t lat_num;
+  size_t check;
+  long dtlb; // dTLB read misses of chase, -1 if not counted
+  uint64_t hop_ns; // time of the hops of chase
+  size_t hops;
+} __attribute__((aligned(64))) Worker;
+
+// object header written by the benchmark: size, and the next object in xmalloc batches
+typedef struct Object {
+  size_t size;
+  struct Object *next;
+} Object;
+
+static Config cfg = {4, 10000, 10, 16, 512, 1, SAMPLE_EVERY, 0, 0, 0};
+static Worker *workers;
+static pthread_barrier_t start_barrier; // threads + main
+static pthread_barrier_t barrier; // threads
+static atomic_size_t peak_heap = 0;
+static atomic_long peak_live = 0;
+static atomic_size_t peak_huge = 0;
+
+// memory of the benchmark itself never comes from the allocator under test
+static void *bench_mmap(size_t size){
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(p == MAP_FAILED){
+    perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+  return p;
+}
+
+static uint64_t now_ns(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// xorshift64
+static uint64_t next_rand(Worker *w){
+  w->rng ^= w->rng << 13;
+  w->rng ^= w->rng >> 7;
+  w->rng ^= w->rng << 17;
+  return w->rng;
+}
+
+static size_t rand_size(Worker *w){
+  return cfg.min_size + next_rand(w) % (cfg.max_size - cfg.min_size + 1);
+}
+
+static void update_max(atomic_size_t *peak, size_t value){
+  size_t cur = atomic_load_explicit(peak, memory_order_relaxed);
+  while(cur < value && !atomic_compare_exchange_weak(peak, &cur, value));
+}
+
+static void update_peak(){
+  long live = 0;
+  for(int i = 0; i < cfg.threads; i++){
+    live += atomic_load_explicit(&workers[i].live, memory_order_relaxed);
+  }
+  update_max(&peak_heap, bench_footprint());
+  long cur = atomic_load_explicit(&peak_live, memory_order_relaxed);
+  while(cur < live && !atomic_compare_exchange_weak(&peak_live, &cur, live));
+}
+
+// count num ops done at once, time them if sampled and check the peak from time to time
+static void ops_done(Worker *w, uint64_t start, size_t num){
+  if(start){
+    w->lat[w->lat_num++] = (now_ns() - start) / num;
+  }
+  w->ops += num;
+  if(w->check <= num){
+    w->check = CHECK_EVERY;
+    update_peak();
+  }else{
+    w->check -= num;
+  }
+}
+
+static void op_done(Worker *w, uint64_t start){
+  ops_done(w, start, 1);
+}
+
+static int sampled(Worker *w){
+  return w->ops % cfg.sample_every == 0 && w->lat_num < MAX_SAMPLES;
+}
+
+static void add_live(Worker *w, long size){
+  atomic_store_explicit(&w->live, atomic_load_explicit(&w->live, memory_order_relaxed) + size, memory_order_relaxed);
+}
+
+static Object *do_malloc(Worker *w, size_t size){
+  uint64_t start = sampled(w) ? now_ns() : 0;
+  Object *p = bench_malloc(size);
+  if(p == NULL){
+    fprintf(stderr, "malloc(%zu) failed\n", size);
+    exit(EXIT_FAILURE);
+  }
+  op_done(w, start);
+  p->size = size;
+  add_live(w, size);
+  return p;
+}
+
+static void do_free(Worker *w, Object *p){
+  add_live(w, -(long)p->size);
+  uint64_t start = sampled(w) ? now_ns() : 0;
+  if(cfg.sized) bench_free_sized(p, p->size);
+  else bench_free(p);
+  op_done(w, start);
+}
+
+/*
+*
+*  Workloads
+*
+*/
+
+static void *larson(Worker *w){
+  static Object **sets[256];
+  size_t num = cfg.objects / cfg.threads;
+  Object **set = bench_mmap(num * sizeof(Object *));
+  for(size_t i = 0; i < num; i++){
+    set[i] = do_malloc(w, rand_size(w));
+  }
+  for(size_t round = 0; round < cfg.iterations; round++){
+    for(size_t i = 0; i < num * LARSON_REPLACE; i++){
+      size_t victim = next_rand(w) % num;
+      do_free(w, set[victim]);
+      set[victim] = do_malloc(w, rand_size(w));
+    }
+    // pass the set to the previous thread
+    sets[w->id] = set;
+    pthread_barrier_wait(&barrier);
+    set = sets[(w->id + 1) % cfg.threads];
+    pthread_barrier_wait(&barrier);
+  }
+  for(size_t i = 0; i < num; i++){
+    do_free(w, set[i]);
+  }
+  return NULL;
+}
+
+static void *threadtest(Worker *w){
+  size_t num = cfg.objects / cfg.threads;
+  Object **objs = bench_mmap(num * sizeof(Object *));
+  for(size_t it = 0; it < cfg.iterations; it++){
+    for(size_t i = 0; i < num; i++){
+      objs[i] = do_malloc(w, cfg.min_size);
+    }
+    for(size_t i = 0; i < num; i++){
+      do_free(w, objs[i]);
+    }
+  }
+  return NULL;
+}
+
+static void cache_work(Worker *w){
+  size_t num = cfg.objects / cfg.threads * cfg.iterations;
+  for(size_t i = 0; i < num; i++){
+    Object *p = do_malloc(w, cfg.min_size);
+    volatile char *data = (char *)p;
+    for(int r = 0; r < CACHE_WRITES; r++){
+      for(size_t j = sizeof(size_t); j < cfg.min_size; j++){
+        data[j]++;
+      }
+    }
+    do_free(w, p);
+  }
+}
+
+static void *cache_scratch(Worker *w){
+  static Object *first[256];
+  if(w->id == 0){
+    for(int i = 0; i < cfg.threads; i++){
+      first[i] = do_malloc(w, cfg.min_size);
+    }
+  }
+  pthread_barrier_wait(&barrier);
+  do_free(w, first[w->id]);
+  cache_work(w);
+  return NULL;
+}
+
+static void *cache_thrash(Worker *w){
+  cache_work(w);
+  return NULL;
+}
+
+// batches of objects linked by next, from producers to consumers
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  Object *batch[XMALLOC_QUEUE];
+  size_t head;
+  size_t num;
+  int producers;
+} queue = {.lock = PTHREAD_MUTEX_INITIALIZER, .not_empty = PTHREAD_COND_INITIALIZER, .not_full = PTHREAD_COND_INITIALIZER};
+
+static void *xmalloc(Worker *w){
+  int producers = cfg.threads / 2;
+  if(w->id < producers){
+    size_t num = cfg.objects * cfg.iterations / producers;
+    for(size_t i = 0; i < num; i += XMALLOC_BATCH){
+      Object *batch = NULL;
+      for(size_t j = i; j < num && j < i + XMALLOC_BATCH; j++){
+        Object *p = do_malloc(w, rand_size(w));
+        p->next = batch;
+        batch = p;
+      }
+      pthread_mutex_lock(&queue.lock);
+      while(queue.num == XMALLOC_QUEUE){
+        pthread_cond_wait(&queue.not_full, &queue.lock);
+      }
+      queue.batch[(queue.head + queue.num++) % XMALLOC_QUEUE] = batch;
+      pthread_cond_signal(&queue.not_empty);
+      pthread_mutex_unlock(&queue.lock);
+    }
+    pthread_mutex_lock(&queue.lock);
+    if(--queue.producers == 0){
+      pthread_cond_broadcast(&queue.not_empty);
+    }
+    pthread_mutex_unlock(&queue.lock);
+    return NULL;
+  }
+  while(1){
+    pthread_mutex_lock(&queue.lock);
+    while(queue.num == 0 && queue.producers > 0){
+      pthread_cond_wait(&queue.not_empty, &queue.lock);
+    }
+    if(queue.num == 0){
+      pthread_mutex_unlock(&queue.lock);
+      return NULL;
+    }
+    Object *batch = queue.batch[queue.head];
+    queue.head = (queue.head + 1) % XMALLOC_QUEUE;
+    queue.num--;
+    pthread_cond_signal(&queue.not_full);
+    pthread_mutex_unlock(&queue.lock);
+    while(batch){
+      Object *next = batch->next;
+      do_free(w, batch);
+      batch = next;
+    }
+  }
+}
+
+static void *random_test(Worker *w){
+  size_t num = cfg.objects / cfg.threads;
+  Object **objs = bench_mmap(num * sizeof(Object *));
+  for(size_t it = 0; it < cfg.iterations; it++){
+    for(size_t i = 0; i < num; i++){
+      objs[i] = do_malloc(w, rand_size(w));
+    }
+    for(size_t i = 0; i < num; i += 2){
+      do_free(w, objs[i]);
+    }
+    for(size_t i = 0; i < num; i += 2){
+      objs[i] = do_malloc(w, rand_size(w));
+    }
+    for(size_t i = 0; i < num; i++){
+      do_free(w, objs[i]);
+    }
+  }
+  return NULL;
+}
+
+static _Atomic uint64_t *churn_slots; // 0 or an object with its stamp
+static atomic_int churn_producers; // producers still running
+
+// malloc an object and fill it with a new stamp, slot gets both
+static void churn_malloc(Worker *w, uint64_t *slot){
+  Object *p = do_malloc(w, cfg.min_size);
+  uint16_t stamp = next_rand(w) | 1;
+  uint16_t *data = (uint16_t *)(p + 1);
+  p->next = (Object *)(uintptr_t)stamp;
+  for(size_t i = 0; i < (cfg.min_size - sizeof(Object)) / sizeof(uint16_t); i++){
+    data[i] = stamp;
+  }
+  *slot = (uint64_t)stamp << CHURN_PTR_BITS | (uintptr_t)p;
+}
+
+// free the object of slot after checking it still holds its stamp
+static void churn_free(Worker *w, uint64_t slot){
+  Object *p = (Object *)(uintptr_t)(slot & (((uint64_t)1 << CHURN_PTR_BITS) - 1));
+  uint16_t stamp = slot >> CHURN_PTR_BITS;
+  uint16_t *data = (uint16_t *)(p + 1);
+  int bad = (uintptr_t)p->next != stamp;
+  for(size_t i = 0; !bad && i < (cfg.min_size - sizeof(Object)) / sizeof(uint16_t); i++){
+    bad = data[i] != stamp;
+  }
+  if(bad){
+    fprintf(stderr, "churn: object %p does not hold its stamp %04x, it was given out twice\n", (void *)p, stamp);
+    exit(EXIT_FAILURE);
+  }
+  do_free(w, p);
+}
+
+static void *churn(Worker *w){
+  size_t slots = cfg.objects / cfg.threads * cfg.threads;
+  size_t goal = cfg.objects / cfg.threads * cfg.iterations;
+  size_t made = 0;
+  int producer = w->id % 2 == 0;
+  int consumer = w->id % 2 == 1 || cfg.threads == 1;
+  if(w->id == 0){
+    churn_slots = bench_mmap(slots * sizeof(uint64_t));
+    atomic_store(&churn_producers, (cfg.threads + 1) / 2);
+  }
+  pthread_barrier_wait(&barrier);
+  while(producer ? made < goal : atomic_load(&churn_producers) > 0){
+    _Atomic uint64_t *slot = &churn_slots[next_rand(w) % slots];
+    uint64_t old = atomic_load_explicit(slot, memory_order_relaxed);
+    if(old == 0 && producer){
+      uint64_t new;
+      churn_malloc(w, &new);
+      if(atomic_compare_exchange_strong(slot, &old, new)) made++;
+      else churn_free(w, new);
+    }else if(old != 0 && consumer){
+      old = atomic_exchange(slot, 0);
+      if(old) churn_free(w, old);
+    }
+  }
+  if(producer) atomic_fetch_sub(&churn_producers, 1);
+  pthread_barrier_wait(&barrier);
+  for(size_t i = w->id; i < slots; i += cfg.threads){
+    uint64_t old = atomic_load(&churn_slots[i]);
+    if(old) churn_free(w, old);
+  }
+  return NULL;
+}
+
+static void *batch(Worker *w){
+  size_t num = cfg.objects / cfg.threads;
+  Object **objs = bench_mmap(num * sizeof(Object *));
+  for(size_t it = 0; it < cfg.iterations; it++){
+    for(size_t i = 0; i < num; i += BATCH_NUM){
+      size_t n = num - i < BATCH_NUM ? num - i : BATCH_NUM;
+      uint64_t start = sampled(w) ? now_ns() : 0;
+      if(bench_malloc_batch(cfg.min_size, n, (void **)(objs + i)) != n){
+        fprintf(stderr, "malloc batch of %zu x %zu failed\n", n, cfg.min_size);
+        exit(EXIT_FAILURE);
+      }
+      ops_done(w, start, n);
+      for(size_t k = i; k < i + n; k++){
+        objs[k]->size = cfg.min_size;
+      }
+      add_live(w, n * cfg.min_size);
+    }
+    for(size_t i = 0; i < num; i += BATCH_NUM){
+      size_t n = num - i < BATCH_NUM ? num - i : BATCH_NUM;
+      add_live(w, -(long)(n * cfg.min_size));
+      uint64_t start = sampled(w) ? now_ns() : 0;
+      bench_free_batch((void **)(objs + i), n);
+      ops_done(w, start, n);
+    }
+  }
+  return NULL;
+}
+
+// dTLB read misses of the calling thread in user space, -1 without the counter (no pmu in a vm)
+static int dtlb_open(void){
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.config = PERF_COUNT_HW_CACHE_DTLB | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static long dtlb_read(int fd){
+  long count;
+  if(fd < 0 || read(fd, &count, sizeof(count)) != sizeof(count)) return -1;
+  return count;
+}
+
+static void *chase(Worker *w){
+  size_t num = cfg.objects / cfg.threads;
+  Object **objs = bench_mmap(num * sizeof(Object *));
+  Object **order = bench_mmap(num * sizeof(Object *));
+  for(size_t i = 0; i < num; i++){
+    order[i] = objs[i] = do_malloc(w, rand_size(w));
+  }
+  // Fisher-Yates, then every object points to the next one in the shuffled order
+  for(size_t i = num - 1; i > 0; i--){
+    size_t k = next_rand(w) % (i + 1);
+    Object *t = order[i];
+    order[i] = order[k];
+    order[k] = t;
+  }
+  for(size_t i = 0; i < num; i++){
+    order[i]->next = order[(i + 1) % num];
+  }
+  int fd = dtlb_open();
+  if(fd >= 0) ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+  Object *volatile sink;
+  Object *p = order[0];
+  uint64_t begin = now_ns();
+  for(size_t it = 0; it < cfg.iterations; it++){
+    uint64_t start = sampled(w) ? now_ns() : 0;
+    for(size_t i = 0; i < num; i++){
+      p = p->next;
+    }
+    sink = p;
+    ops_done(w, start, num);
+  }
+  (void)sink;
+  w->hop_ns = now_ns() - begin;
+  w->hops = cfg.iterations * num;
+  if(fd >= 0) ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+  w->dtlb = dtlb_read(fd);
+  if(fd >= 0) close(fd);
+  update_max(&peak_huge, bench_huge_bytes());
+  // in the order of malloc, the hops are what is measured
+  for(size_t i = 0; i < num; i++){
+    do_free(w, objs[i]);
+  }
+  return NULL;
+}
+
+static pthread_key_t exit_key;
+static pthread_once_t exit_once = PTHREAD_ONCE_INIT;
+static __thread Worker *exit_worker; // the worker which started this short thread
+static size_t exit_heap; // heap after the first half of the short threads
+
+// runs after the destructors of the allocator, whose keys are created first
+static void exit_destructor(void *arg){
+  do_free(exit_worker, arg);
+}
+
+static void exit_key_init(void){
+  pthread_key_create(&exit_key, exit_destructor);
+}
+
+static void *exit_thread(void *arg){
+  exit_worker = arg;
+  do_free(exit_worker, do_malloc(exit_worker, cfg.min_size));
+  pthread_setspecific(exit_key, do_malloc(exit_worker, cfg.min_size));
+  return NULL;
+}
+
+static void exit_threads(Worker *w, size_t num){
+  for(size_t i = 0; i < num; i++){
+    pthread_t t;
+    if(pthread_create(&t, NULL, exit_thread, w) != 0){
+      perror("pthread_create");
+      exit(EXIT_FAILURE);
+    }
+    pthread_join(t, NULL);
+  }
+}
+
+static void *thread_exit(Worker *w){
+  size_t num = cfg.objects / cfg.threads;
+  do_free(w, do_malloc(w, cfg.min_size)); // the allocator creates its keys before exit_key
+  pthread_once(&exit_once, exit_key_init);
+  exit_threads(w, num / 2);
+  pthread_barrier_wait(&barrier);
+  if(w->id == 0) exit_heap = bench_footprint();
+  pthread_barrier_wait(&barrier);
+  exit_threads(w, num - num / 2);
+  pthread_barrier_wait(&barrier);
+  size_t lost = (num - num / 2) * cfg.threads * cfg.min_size;
+  if(w->id == 0 && bench_footprint() >= exit_heap + lost){
+    fprintf(stderr, "exit: the heap grew from %zu to %zu bytes, the objects freed by key destructors were lost\n",
+            exit_heap, bench_footprint());
+    exit(EXIT_FAILURE);
+  }
+  return NULL;
+}
+
+static const struct {
+  const char *name;
+  void *(*run)(Worker *);
+} workloads[] = {
+  {"larson", larson},
+  {"threadtest", threadtest},
+  {"cache-scratch", cache_scratch},
+  {"cache-thrash", cache_thrash},
+  {"xmalloc", xmalloc},
+  {"random", random_test},
+  {"churn", churn},
+  {"batch", batch},
+  {"chase", chase},
+  {"exit", thread_exit},
+};
+
+/*
+*
+*  Driver
+*
+*/
+
+static void *(*workload)(Worker *);
+
+static void *thread_main(void *arg){
+  Worker *w = arg;
+  pthread_barrier_wait(&start_barrier);
+  return workload(w);
+}
+
+static int cmp_size(const void *a, const void *b){
+  size_t x = *(const size_t *)a, y = *(const size_t *)b;
+  return (x > y) - (x < y);
+}
+
+static void usage(const char *prog){
+  fprintf(stderr, "usage: %s <workload> [-t threads] [-n objects] [-i iterations] "
+          "[-s min_size] [-S max_size] [-r seed] [-e sample_every] [-z] [-d defer_limit] [-H]\nworkloads:", prog);
+  for(size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++){
+    fprintf(stderr, " %s", workloads[i].name);
+  }
+  fprintf(stderr, "\n");
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv){
+  if(argc < 2) usage(argv[0]);
+  const char *name = argv[1];
+  for(size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++){
+    if(strcmp(name, workloads[i].name) == 0) workload = workloads[i].run;
+  }
+  if(workload == NULL) usage(argv[0]);
+  int opt;
+  optind = 2;
+  while((opt = getopt(argc, argv, "t:n:i:s:S:r:e:zd:H")) != -1){
+    switch(opt){
+      case 't': cfg.threads = atoi(optarg); break;
+      case 'n': cfg.objects = strtoull(optarg, NULL, 10); break;
+      case 'i': cfg.iterations = strtoull(optarg, NULL, 10); break;
+      case 's': cfg.min_size = strtoull(optarg, NULL, 10); break;
+      case 'S': cfg.max_size = strtoull(optarg, NULL, 10); break;
+      case 'r': cfg.seed = strtoull(optarg, NULL, 10); break;
+      case 'e': cfg.sample_every = strtoull(optarg, NULL, 10); break;
+      case 'z': cfg.sized = 1; break;
+      case 'd': cfg.defer = strtoull(optarg, NULL, 10); break;
+      case 'H': cfg.huge = 1; break;
+      default: usage(argv[0]);
+    }
+  }
+  if(cfg.threads < 1) cfg.threads = 1;
+  if(cfg.sample_every < 1) cfg.sample_every = 1;
+  if(cfg.threads > 256) cfg.threads = 256;
+  if(workload == xmalloc && cfg.threads < 2) cfg.threads = 2;
+  if(cfg.min_size < sizeof(Object)) cfg.min_size = sizeof(Object);
+  if(cfg.max_size < cfg.min_size) cfg.max_size = cfg.min_size;
+  if(cfg.objects < (size_t)cfg.threads) cfg.objects = cfg.threads;
+  queue.producers = cfg.threads / 2;
+  if(cfg.defer) bench_defer_coalescing(cfg.defer);
+  if(cfg.huge && bench_huge_pages(1) != 0){
+    fprintf(stderr, "%s: no transparent huge pages, running without them\n", ALLOC_NAME);
+    cfg.huge = 0;
+  }
+
+  workers = bench_mmap(cfg.threads * sizeof(Worker));
+  pthread_t *tids = bench_mmap(cfg.threads * sizeof(pthread_t));
+  pthread_barrier_init(&start_barrier, NULL, cfg.threads + 1);
+  pthread_barrier_init(&barrier, NULL, cfg.threads);
+  for(int i = 0; i < cfg.threads; i++){
+    workers[i].id = i;
+    workers[i].rng = cfg.seed * 0x9E3779B97F4A7C15ull + i + 1;
+    workers[i].check = CHECK_EVERY;
+    workers[i].dtlb = -1;
+    workers[i].lat = bench_mmap(MAX_SAMPLES * sizeof(size_t));
+    pthread_create(&tids[i], NULL, thread_main, &workers[i]);
+  }
+  // every thread is created before the clock starts
+  pthread_barrier_wait(&start_barrier);
+  uint64_t start = now_ns();
+  for(int i = 0; i < cfg.threads; i++){
+    pthread_join(tids[i], NULL);
+  }
+  double seconds = (now_ns() - start) / 1e9;
+  update_peak();
+
+  size_t ops = 0, lat_num = 0;
+  for(int i = 0; i < cfg.threads; i++){
+    ops += workers[i].ops;
+    lat_num += workers[i].lat_num;
+  }
+  size_t *lat = bench_mmap((lat_num + 1) * sizeof(size_t));
+  for(int i = 0, k = 0; i < cfg.threads; i++){
+    memcpy(lat + k, workers[i].lat, workers[i].lat_num * sizeof(size_t));
+    k += workers[i].lat_num;
+  }
+  qsort(lat, lat_num, sizeof(size_t), cmp_size);
+  size_t heap = atomic_load(&peak_heap);
+  update_max(&peak_huge, bench_huge_bytes());
+  long live = atomic_load(&peak_live);
+  long dtlb = -1;
+  uint64_t hop_ns = 0;
+  size_t hops = 0;
+  for(int i = 0; i < cfg.threads; i++){
+    if(workers[i].dtlb >= 0) dtlb = (dtlb < 0 ? 0 : dtlb) + workers[i].dtlb;
+    hop_ns += workers[i].hop_ns;
+    hops += workers[i].hops;
+  }
+
+  printf("{\"alloc\":\"%s\",\"workload\":\"%s\",\"threads\":%d,\"objects\":%zu,"
+         "\"iterations\":%zu,\"min_size\":%zu,\"max_size\":%zu,\"sized\":%d,\"defer\":%zu,\"huge\":%d,\"ops\":%zu,"
+         "\"seconds\":%.6f,\"ops_per_sec\":%.0f,\"p50_ns\":%zu,\"p99_ns\":%zu,\"p999_ns\":%zu,\"max_ns\":%zu,"
+         "\"peak_heap\":%zu,\"peak_live\":%ld,\"fragmentation\":%.3f,\"search_steps\":%zu,"
+         "\"huge_bytes\":%zu,\"hop_ns\":%.2f,\"dtlb_misses\":%ld}\n",
+         ALLOC_NAME, name, cfg.threads, cfg.objects, cfg.iterations, cfg.min_size, cfg.max_size,
+         cfg.sized, cfg.defer, cfg.huge, ops, seconds, ops / seconds, lat[lat_num * 50 / 100], lat[lat_num * 99 / 100],
+         lat[lat_num * 999 / 1000], lat_num > 0 ? lat[lat_num - 1] : 0, heap, live, live > 0 ? (double)heap / live : 0.0,
+         bench_search_steps(), atomic_load(&peak_huge), hops ? (double)hop_ns / hops : 0.0, dtlb);
+  return 0;
+}
@@ -0,0 +1,158 @@
+#ifndef __BENCH_ALLOC__
+#define __BENCH_ALLOC__
+#include <stdlib.h>
+#include <pthread.h>
+/**
+ * @brief the allocator a benchmark binary runs against, chosen when building:
+ *
+ *   -DALLOC_FF      ff_malloc / ff_free        (plain_malloc, under one global mutex)
+ *   -DALLOC_BF      bf_malloc / bf_free        (plain_malloc, under one global mutex)
+ *   -DALLOC_TLSF    tlsf_malloc / tlsf_free    (plain_malloc, under one global mutex)
+ *   -DALLOC_NF      nf_malloc / nf_free        (plain_malloc, under one global mutex)
+ *   -DALLOC_AO      ao_malloc / ao_free        (plain_malloc, under one global mutex)
+ *   -DALLOC_LOCK    ts_malloc_lock / ts_free_lock
+ *   -DALLOC_NOLOCK  ts_malloc_nolock / ts_free_nolock
+ *   -DALLOC_GLIBC   malloc / free
+ *
+ * footprint is the memory taken from os: data segment + mmap blocks,
+ * bench_malloc_batch / bench_free_batch are one call per object without a batch api,
+ * bench_free_sized is free for glibc (free_sized needs glibc 2.41), bench_defer_coalescing turns on
+ * deferred coalescing of the plain and nolock versions (the lock version defers with its thread cache,
+ * glibc with its fastbins / tcache anyway), bench_search_steps is the search length of the plain versions,
+ * bench_huge_pages backs the heap of the thread versions by transparent huge pages (-1 for the others,
+ * glibc takes GLIBC_TUNABLES=glibc.malloc.hugetlb=1) and bench_huge_bytes is how much of it is
+ */
+
+#if defined(ALLOC_FF) || defined(ALLOC_BF) || defined(ALLOC_TLSF) || defined(ALLOC_NF) || defined(ALLOC_AO)
+#include "my_malloc.h"
+// the plain version is not thread safe
+static pthread_mutex_t bench_lock = PTHREAD_MUTEX_INITIALIZER;
+#ifdef ALLOC_FF
+#define ALLOC_NAME "ff"
+#define PLAIN_MALLOC ff_malloc
+#define PLAIN_FREE ff_free
+#define PLAIN_FREE_SIZED ff_free_sized
+#define PLAIN_REALLOC ff_realloc
+#elif defined(ALLOC_BF)
+#define ALLOC_NAME "bf"
+#define PLAIN_MALLOC bf_malloc
+#define PLAIN_FREE bf_free
+#define PLAIN_FREE_SIZED bf_free_sized
+#define PLAIN_REALLOC bf_realloc
+#elif defined(ALLOC_NF)
+#define ALLOC_NAME "nf"
+#define PLAIN_MALLOC nf_malloc
+#define PLAIN_FREE nf_free
+#define PLAIN_FREE_SIZED nf_free_sized
+#define PLAIN_REALLOC nf_realloc
+#elif defined(ALLOC_AO)
+#define ALLOC_NAME "ao"
+#define PLAIN_MALLOC ao_malloc
+#define PLAIN_FREE ao_free
+#define PLAIN_FREE_SIZED ao_free_sized
+#define PLAIN_REALLOC ao_realloc
+#else
+#define ALLOC_NAME "tlsf"
+#define PLAIN_MALLOC tlsf_malloc
+#define PLAIN_FREE tlsf_free
+#define PLAIN_FREE_SIZED tlsf_free_sized
+#define PLAIN_REALLOC tlsf_realloc
+#endif
+static inline void *bench_malloc(size_t size){
+  pthread_mutex_lock(&bench_lock);
+  void *p = PLAIN_MALLOC(size);
+  pthread_mutex_unlock(&bench_lock);
+  return p;
+}
+static inline void bench_free(void *ptr){
+  pthread_mutex_lock(&bench_lock);
+  PLAIN_FREE(ptr);
+  pthread_mutex_unlock(&bench_lock);
+}
+static inline void bench_free_sized(void *ptr, size_t size){
+  pthread_mutex_lock(&bench_lock);
+  PLAIN_FREE_SIZED(ptr, size);
+  pthread_mutex_unlock(&bench_lock);
+}
+static inline void *bench_realloc(void *ptr, size_t size){
+  pthread_mutex_lock(&bench_lock);
+  void *p = PLAIN_REALLOC(ptr, size);
+  pthread_mutex_unlock(&bench_lock);
+  return p;
+}
+static inline size_t bench_footprint(void){
+  return get_data_segment_size() + get_mmap_size();
+}
+static inline void bench_defer_coalescing(size_t limit){ set_defer_coalescing(limit); }
+static inline size_t bench_search_steps(void){ return get_search_steps(); }
+static inline int bench_huge_pages(int on){ (void)on; return -1; }
+static inline size_t bench_huge_bytes(void){ return 0; }
+
+#elif defined(ALLOC_LOCK)
+#include "my_malloc.h"
+#define ALLOC_NAME "lock"
+static inline void *bench_malloc(size_t size){ return ts_malloc_lock(size); }
+static inline void bench_free(void *ptr){ ts_free_lock(ptr); }
+static inline void bench_free_sized(void *ptr, size_t size){ ts_free_sized_lock(ptr, size); }
+static inline void *bench_realloc(void *ptr, size_t size){ return ts_realloc_lock(ptr, size); }
+static inline size_t bench_footprint(void){
+  return get_data_segment_size() + get_mmap_size();
+}
+static inline void bench_defer_coalescing(size_t limit){ (void)limit; }
+static inline size_t bench_search_steps(void){ return 0; }
+static inline int bench_huge_pages(int on){ return ts_set_huge_pages(on); }
+static inline size_t bench_huge_bytes(void){ return my_malloc_huge_bytes(); }
+#define BENCH_BATCH
+static inline size_t bench_malloc_batch(size_t size, size_t num, void **ptrs){ return my_malloc_batch(size, num, ptrs); }
+static inline void bench_free_batch(void **ptrs, size_t num){ my_free_batch(ptrs, num); }
+
+#elif defined(ALLOC_NOLOCK)
+#include "my_malloc.h"
+#define ALLOC_NAME "nolock"
+static inline void *bench_malloc(size_t size){ return ts_malloc_nolock(size); }
+static inline void bench_free(void *ptr){ ts_free_nolock(ptr); }
+static inline void bench_free_sized(void *ptr, size_t size){ ts_free_sized_nolock(ptr, size); }
+static inline void *bench_realloc(void *ptr, size_t size){ return ts_realloc_nolock(ptr, size); }
+static inline size_t bench_footprint(void){
+  return get_data_segment_size() + get_mmap_size();
+}
+static inline void bench_defer_coalescing(size_t limit){ ts_set_defer_coalescing(limit); }
+static inline size_t bench_search_steps(void){ return 0; }
+static inline int bench_huge_pages(int on){ return ts_set_huge_pages(on); }
+static inline size_t bench_huge_bytes(void){ return my_malloc_huge_bytes(); }
+
+#elif defined(ALLOC_GLIBC)
+#include <malloc.h>
+#define ALLOC_NAME "glibc"
+static inline void *bench_malloc(size_t size){ return malloc(size); }
+static inline void bench_free(void *ptr){ free(ptr); }
+static inline void bench_free_sized(void *ptr, size_t size){ (void)size; free(ptr); }
+static inline void *bench_realloc(void *ptr, size_t size){ return realloc(ptr, size); }
+static inline size_t bench_footprint(void){
+  struct mallinfo2 info = mallinfo2();
+  return info.arena + info.hblkhd;
+}
+static inline void bench_defer_coalescing(size_t limit){ (void)limit; }
+static inline size_t bench_search_steps(void){ return 0; }
+static inline int bench_huge_pages(int on){ (void)on; return -1; }
+static inline size_t bench_huge_bytes(void){ return 0; }
+
+#else
+#error "define one of ALLOC_FF, ALLOC_BF, ALLOC_TLSF, ALLOC_NF, ALLOC_AO, ALLOC_LOCK, ALLOC_NOLOCK, ALLOC_GLIBC"
+#endif
+
+#ifndef BENCH_BATCH
+static inline size_t bench_malloc_batch(size_t size, size_t num, void **ptrs){
+  for(size_t i = 0; i < num; i++){
+    if((ptrs[i] = bench_malloc(size)) == NULL) return i;
+  }
+  return num;
+}
+static inline void bench_free_batch(void **ptrs, size_t num){
+  for(size_t i = 0; i < num; i++){
+    bench_free(ptrs[i]);
+  }
+}
+#endif
+
+#endif
@@ -0,0 +1,223 @@
+#include "my_malloc_allocator.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <map>
+#include <memory_resource>
+#include <string>
+#include <unordered_map>
+#include <unistd.h>
+#include <vector>
+/**
+ * @brief container workloads on my_malloc_allocator.h against the default allocator of C++
+ *
+ * usage: ./bench_cxx_<alloc> <workload> [-n objects] [-i iterations] [-s min_size] [-S max_size] [-r seed] [-D]
+ *
+ * workloads:
+ *   map     std::map<uint64_t, uint64_t>, every op erases a random key or inserts it if it is not there,
+ *           so the map holds about objects / 2 nodes of one size
+ *   umap    the same with std::unordered_map, whose bucket array grows with it
+ *   string  a vector of objects strings of min_size to max_size chars (min_size > 15 is past the small
+ *           string buffer), every op replaces a random one by a new string of random length
+ *
+ * every workload runs iterations * objects ops twice, each printing one JSON line with ops per second:
+ *   api "allocator"  containers of my_malloc::allocator<T, Heap>
+ *   api "pmr"        std::pmr containers on my_malloc::resource<Heap>
+ * -D runs them on the default allocator instead (std::allocator and new_delete_resource, alloc "default").
+ * It is a run of its own, since glibc malloc and the sbrk heap of a version cannot grow the break in turns
+ */
+
+#if defined(ALLOC_FF)
+#define ALLOC_NAME "ff"
+typedef my_malloc::ff_heap Heap;
+#elif defined(ALLOC_BF)
+#define ALLOC_NAME "bf"
+typedef my_malloc::bf_heap Heap;
+#elif defined(ALLOC_LOCK)
+#define ALLOC_NAME "lock"
+typedef my_malloc::lock_heap Heap;
+#elif defined(ALLOC_NOLOCK)
+#define ALLOC_NAME "nolock"
+typedef my_malloc::nolock_heap Heap;
+#else
+#error "define one of ALLOC_FF, ALLOC_BF, ALLOC_LOCK, ALLOC_NOLOCK"
+#endif
+
+template <class T> using Mine = my_malloc::allocator<T, Heap>;
+
+struct Config {
+  size_t objects;
+  size_t iterations;
+  size_t min_size;
+  size_t max_size;
+  uint64_t seed;
+  int by_default; // the default allocator of C++
+};
+
+static Config cfg = {100000, 10, 16, 256, 1, 0};
+static uint64_t rng;
+
+static uint64_t now_ns(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// xorshift64
+static uint64_t next_rand(){
+  rng ^= rng << 13;
+  rng ^= rng >> 7;
+  rng ^= rng << 17;
+  return rng;
+}
+
+static size_t rand_size(){
+  return cfg.min_size + next_rand() % (cfg.max_size - cfg.min_size + 1);
+}
+
+/*
+*
+*  Workloads, one template for every container type
+*
+*/
+
+template <class Map>
+static size_t map_churn(Map &m){
+  size_t ops = cfg.objects * cfg.iterations;
+  for(size_t i = 0; i < ops; i++){
+    uint64_t key = next_rand() % cfg.objects;
+    if(m.erase(key) == 0) m.emplace(key, i);
+  }
+  return ops;
+}
+
+template <class Vector>
+static size_t string_churn(Vector &v){
+  typedef typename Vector::value_type String;
+  for(size_t i = 0; i < cfg.objects; i++){
+    v.emplace_back(rand_size(), 'a' + i % 26);
+  }
+  size_t ops = cfg.objects * cfg.iterations;
+  for(size_t i = 0; i < ops; i++){
+    String s(rand_size(), 'a' + i % 26, v.get_allocator());
+    v[next_rand() % cfg.objects] = std::move(s);
+  }
+  return ops;
+}
+
+typedef std::pair<const uint64_t, uint64_t> Pair;
+
+static size_t map_default(){
+  std::map<uint64_t, uint64_t> m;
+  return map_churn(m);
+}
+static size_t map_mine(){
+  std::map<uint64_t, uint64_t, std::less<uint64_t>, Mine<Pair>> m;
+  return map_churn(m);
+}
+static size_t map_pmr(std::pmr::memory_resource *res){
+  std::pmr::map<uint64_t, uint64_t> m(res);
+  return map_churn(m);
+}
+
+static size_t umap_default(){
+  std::unordered_map<uint64_t, uint64_t> m;
+  return map_churn(m);
+}
+static size_t umap_mine(){
+  std::unordered_map<uint64_t, uint64_t, std::hash<uint64_t>, std::equal_to<uint64_t>, Mine<Pair>> m;
+  return map_churn(m);
+}
+static size_t umap_pmr(std::pmr::memory_resource *res){
+  std::pmr::unordered_map<uint64_t, uint64_t> m(res);
+  return map_churn(m);
+}
+
+typedef std::basic_string<char, std::char_traits<char>, Mine<char>> MyString;
+
+static size_t string_default(){
+  std::vector<std::string> v;
+  return string_churn(v);
+}
+static size_t string_mine(){
+  std::vector<MyString, Mine<MyString>> v;
+  return string_churn(v);
+}
+static size_t string_pmr(std::pmr::memory_resource *res){
+  std::pmr::vector<std::pmr::string> v(res);
+  return string_churn(v);
+}
+
+static const struct {
+  const char *name;
+  size_t (*run_default)();
+  size_t (*run_mine)();
+  size_t (*run_pmr)(std::pmr::memory_resource *);
+} workloads[] = {
+  {"map", map_default, map_mine, map_pmr},
+  {"umap", umap_default, umap_mine, umap_pmr},
+  {"string", string_default, string_mine, string_pmr},
+};
+
+/*
+*
+*  Driver
+*
+*/
+
+static void report(const char *alloc, const char *api, const char *name, const std::function<size_t()> &run){
+  rng = cfg.seed * 0x9E3779B97F4A7C15ull + 1; // every run sees the same ops
+  uint64_t start = now_ns();
+  size_t ops = run();
+  double seconds = (now_ns() - start) / 1e9;
+  printf("{\"alloc\":\"%s\",\"api\":\"%s\",\"workload\":\"%s\",\"objects\":%zu,\"iterations\":%zu,"
+         "\"min_size\":%zu,\"max_size\":%zu,\"ops\":%zu,\"seconds\":%.6f,\"ops_per_sec\":%.0f}\n",
+         alloc, api, name, cfg.objects, cfg.iterations, cfg.min_size, cfg.max_size, ops, seconds, ops / seconds);
+}
+
+static void usage(const char *prog){
+  fprintf(stderr, "usage: %s <workload> [-n objects] [-i iterations] [-s min_size] [-S max_size] [-r seed] [-D]\n"
+          "workloads:", prog);
+  for(size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++){
+    fprintf(stderr, " %s", workloads[i].name);
+  }
+  fprintf(stderr, "\n");
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv){
+  if(argc < 2) usage(argv[0]);
+  int w = -1;
+  for(size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++){
+    if(strcmp(argv[1], workloads[i].name) == 0) w = i;
+  }
+  if(w < 0) usage(argv[0]);
+  int opt;
+  optind = 2;
+  while((opt = getopt(argc, argv, "n:i:s:S:r:D")) != -1){
+    switch(opt){
+      case 'n': cfg.objects = strtoull(optarg, NULL, 10); break;
+      case 'i': cfg.iterations = strtoull(optarg, NULL, 10); break;
+      case 's': cfg.min_size = strtoull(optarg, NULL, 10); break;
+      case 'S': cfg.max_size = strtoull(optarg, NULL, 10); break;
+      case 'r': cfg.seed = strtoull(optarg, NULL, 10); break;
+      case 'D': cfg.by_default = 1; break;
+      default: usage(argv[0]);
+    }
+  }
+  if(cfg.objects < 1) cfg.objects = 1;
+  if(cfg.max_size < cfg.min_size) cfg.max_size = cfg.min_size;
+
+  const char *name = workloads[w].name;
+  if(cfg.by_default){
+    report("default", "allocator", name, workloads[w].run_default);
+    report("default", "pmr", name, [&]{ return workloads[w].run_pmr(std::pmr::new_delete_resource()); });
+  }else{
+    report(ALLOC_NAME, "allocator", name, workloads[w].run_mine);
+    report(ALLOC_NAME, "pmr", name, [&]{ return workloads[w].run_pmr(my_malloc::resource<Heap>::get()); });
+  }
+  return 0;
+}
@@ -0,0 +1,156 @@
+#ifndef __MY_MALLOC_ALLOCATOR__
+#define __MY_MALLOC_ALLOCATOR__
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory_resource>
+#include <new>
+#include <type_traits>
+/**
+ * @brief C++ allocators on top of every version, header only (C++17)
+ *
+ *   my_malloc::allocator<T, Heap>  std::allocator compatible, for std::vector, std::map, std::unordered_map ...
+ *   my_malloc::resource<Heap>      std::pmr::memory_resource, for std::pmr::vector, std::pmr::string ...
+ *
+ * Heap is one of ff_heap, bf_heap (plain_malloc, link my_malloc.c of plain_malloc) or lock_heap,
+ * nolock_heap (thread_malloc). The versions define the same C names (get_data_segment_size ...), so a
+ * program links the plain or the thread-safe ones, and only the heaps it uses reference their functions.
+ * ff_allocator<T>, bf_resource() ... are the short names. The plain heaps are not thread safe, as ff_malloc.
+ *
+ * Every block is freed with the size it is malloced with (ff_free_sized ... ts_free_sized_nolock). An
+ * alignment above the one of the version (8 bytes plain, 16 bytes thread-safe) goes to ts_memalign_*, the
+ * plain heaps malloc alignment more bytes and keep the pointer malloc returned in the word in front of the
+ * aligned one. A failed malloc throws std::bad_alloc.
+ */
+
+extern "C" {
+void *ff_malloc(std::size_t size);
+void ff_free_sized(void *ptr, std::size_t size);
+void *bf_malloc(std::size_t size);
+void bf_free_sized(void *ptr, std::size_t size);
+void *ts_malloc_lock(std::size_t size);
+void *ts_memalign_lock(std::size_t alignment, std::size_t size);
+void ts_free_sized_lock(void *ptr, std::size_t size);
+void *ts_malloc_nolock(std::size_t size);
+void *ts_memalign_nolock(std::size_t alignment, std::size_t size);
+void ts_free_sized_nolock(void *ptr, std::size_t size);
+}
+
+namespace my_malloc {
+
+// a plain version aligns its payload to 8 bytes only, larger alignments are carved from a larger block
+template <void *(*Malloc)(std::size_t), void (*FreeSized)(void *, std::size_t)>
+struct plain_heap {
+  static constexpr std::size_t alignment = 8;
+
+  static void *allocate(std::size_t size, std::size_t align){
+    if(size == 0) size = 1;
+    if(align <= alignment){
+      void *p = Malloc(size);
+      if(p == nullptr) throw std::bad_alloc();
+      return p;
+    }
+    if(size > std::numeric_limits<std::size_t>::max() - align) throw std::bad_alloc();
+    void *raw = Malloc(size + align);
+    if(raw == nullptr) throw std::bad_alloc();
+    // raw is 8-aligned, so there is at least one word in front of the aligned pointer
+    void *p = reinterpret_cast<void *>((reinterpret_cast<std::uintptr_t>(raw) + align) & ~(align - 1));
+    static_cast<void **>(p)[-1] = raw;
+    return p;
+  }
+
+  static void deallocate(void *p, std::size_t size, std::size_t align) noexcept {
+    if(p == nullptr) return;
+    if(size == 0) size = 1;
+    if(align <= alignment) FreeSized(p, size);
+    else FreeSized(static_cast<void **>(p)[-1], size + align);
+  }
+};
+
+// the thread-safe versions align to 16 bytes and tag larger alignments in the header
+template <void *(*Malloc)(std::size_t), void *(*Memalign)(std::size_t, std::size_t),
+          void (*FreeSized)(void *, std::size_t)>
+struct thread_heap {
+  static constexpr std::size_t alignment = 16;
+
+  static void *allocate(std::size_t size, std::size_t align){
+    if(size == 0) size = 1;
+    void *p = align <= alignment ? Malloc(size) : Memalign(align, size);
+    if(p == nullptr) throw std::bad_alloc();
+    return p;
+  }
+
+  static void deallocate(void *p, std::size_t size, std::size_t) noexcept {
+    FreeSized(p, size == 0 ? 1 : size);
+  }
+};
+
+using ff_heap = plain_heap<ff_malloc, ff_free_sized>;
+using bf_heap = plain_heap<bf_malloc, bf_free_sized>;
+using lock_heap = thread_heap<ts_malloc_lock, ts_memalign_lock, ts_free_sized_lock>;
+using nolock_heap = thread_heap<ts_malloc_nolock, ts_memalign_nolock, ts_free_sized_nolock>;
+
+// stateless, every allocator of one heap frees the blocks of the others
+template <class T, class Heap>
+class allocator {
+ public:
+  using value_type = T;
+  using is_always_equal = std::true_type;
+  template <class U> struct rebind { using other = allocator<U, Heap>; };
+
+  allocator() noexcept = default;
+  template <class U> allocator(const allocator<U, Heap> &) noexcept {}
+
+  T *allocate(std::size_t n){
+    if(n > std::numeric_limits<std::size_t>::max() / sizeof(T)) throw std::bad_array_new_length();
+    return static_cast<T *>(Heap::allocate(n * sizeof(T), alignof(T)));
+  }
+
+  void deallocate(T *p, std::size_t n) noexcept {
+    Heap::deallocate(p, n * sizeof(T), alignof(T));
+  }
+};
+
+template <class T, class U, class Heap>
+bool operator==(const allocator<T, Heap> &, const allocator<U, Heap> &) noexcept { return true; }
+template <class T, class U, class Heap>
+bool operator!=(const allocator<T, Heap> &, const allocator<U, Heap> &) noexcept { return false; }
+
+template <class T> using ff_allocator = allocator<T, ff_heap>;
+template <class T> using bf_allocator = allocator<T, bf_heap>;
+template <class T> using lock_allocator = allocator<T, lock_heap>;
+template <class T> using nolock_allocator = allocator<T, nolock_heap>;
+
+// get() is the one resource of a heap, never destroyed (as std::pmr::new_delete_resource), so containers
+// with static storage can still free into it at exit
+template <class Heap>
+class resource : public std::pmr::memory_resource {
+ public:
+  static resource *get() noexcept {
+    alignas(resource) static unsigned char storage[sizeof(resource)];
+    static resource *res = ::new (storage) resource();
+    return res;
+  }
+
+ private:
+  void *do_allocate(std::size_t bytes, std::size_t align) override {
+    return Heap::allocate(bytes, align);
+  }
+
+  void do_deallocate(void *p, std::size_t bytes, std::size_t align) override {
+    Heap::deallocate(p, bytes, align);
+  }
+
+  bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+    return this == &other;
+  }
+};
+
+inline std::pmr::memory_resource *ff_resource() noexcept { return resource<ff_heap>::get(); }
+inline std::pmr::memory_resource *bf_resource() noexcept { return resource<bf_heap>::get(); }
+inline std::pmr::memory_resource *lock_resource() noexcept { return resource<lock_heap>::get(); }
+inline std::pmr::memory_resource *nolock_resource() noexcept { return resource<nolock_heap>::get(); }
+
+} // namespace my_malloc
+
+#endif
@@ -0,0 +1,402 @@
+#include "bench_alloc.h"
+#include "my_malloc_trace.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+/**
+ * @brief replay a trace written by my_malloc_trace_start / MY_MALLOC_TRACE
+ *
+ * usage: ./replay_<alloc> <trace> [-s] [-d]
+ *   -s  replay all events in one thread, in time order
+ *   -d  print the events with their object ids instead of replaying them
+ *
+ * By default every thread of the trace is replayed by its own thread as fast as it can.
+ * An event waits until the events before it on the same object are done, so frees of
+ * objects malloced by other threads still see them. calloc is replayed as malloc + memset,
+ * memalign as malloc. Frees of objects malloced before the trace started are skipped.
+ *
+ * prints one JSON line: time, ops/sec, peak heap (data segment + mmap blocks), peak live
+ * bytes and fragmentation = peak heap / peak live bytes
+ */
+
+#define CHECK_EVERY 4096 // ops between two checks of the peak heap size
+
+// an event of the trace after the addresses are turned into object ids
+typedef struct {
+  uint64_t id;
+  uint64_t size;
+  uint32_t op; // TRACE_MALLOC, TRACE_CALLOC, TRACE_MEMALIGN, TRACE_FREE or TRACE_REALLOC_END
+  uint32_t step; // number of events on the object before this one
+} ReplayOp;
+
+typedef struct {
+  void * _Atomic ptr;
+  _Atomic uint32_t step; // number of events on the object done
+  uint64_t size;
+} Object;
+
+// events replayed by one thread
+typedef struct {
+  ReplayOp *op;
+  size_t num;
+  atomic_long live;
+  size_t check;
+} __attribute__((aligned(64))) Worker;
+
+// address -> object id of the live objects, open addressing
+typedef struct {
+  uint64_t *addr; // 0 for an empty slot, 1 for a removed one
+  uint64_t *id;
+  size_t mask;
+} AddrMap;
+
+static Object *objects;
+static Worker *workers;
+static uint32_t thread_num = 0;
+static atomic_size_t peak_heap = 0;
+static atomic_long peak_live = 0;
+
+// memory of the replay itself never comes from the allocator under test
+static void *bench_mmap(size_t size){
+  void *p = mmap(NULL, size ? size : 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(p == MAP_FAILED){
+    perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+  return p;
+}
+
+static uint64_t now_ns(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+*
+*  Load: sort the events by time, give every object an id and split the events by thread
+*
+*/
+
+static size_t map_slot(AddrMap *map, uint64_t addr){
+  size_t i = (addr >> 4) * 0x9E3779B97F4A7C15ull & map->mask;
+  while(map->addr[i] != 0 && map->addr[i] != addr){
+    i = (i + 1) & map->mask;
+  }
+  return i;
+}
+
+static void map_put(AddrMap *map, uint64_t addr, uint64_t id){
+  size_t i = map_slot(map, addr);
+  map->addr[i] = addr;
+  map->id[i] = id;
+}
+
+// remove addr from the map, return its id or -1
+static int64_t map_take(AddrMap *map, uint64_t addr){
+  size_t i = map_slot(map, addr);
+  if(map->addr[i] == 0) return -1;
+  map->addr[i] = 1;
+  return map->id[i];
+}
+
+// sort pointers to the events, so the events of a thread at the same time keep their order in the file
+static int cmp_event(const void *a, const void *b){
+  const TraceEvent *x = *(TraceEvent * const *)a, *y = *(TraceEvent * const *)b;
+  if(x->time != y->time) return (x->time > y->time) - (x->time < y->time);
+  if(x->thread != y->thread) return (x->thread > y->thread) - (x->thread < y->thread);
+  return (x > y) - (x < y);
+}
+
+// move the frees a thread starts a run of the same time with to the front of the run, their
+// addresses may be the ones the mallocs of other threads return, the order of a thread is kept
+static void frees_first(TraceEvent **order, size_t num, TraceEvent **tmp){
+  for(size_t i = 0, j; i < num; i = j){
+    size_t lead_num = 0, rest_num = 0;
+    uint32_t thread = 0;
+    int lead = 0;
+    for(j = i; j < num && order[j]->time == order[i]->time; j++){
+      if(j == i || order[j]->thread != thread) lead = 1;
+      thread = order[j]->thread;
+      lead = lead && order[j]->op == TRACE_FREE;
+      if(lead) tmp[lead_num++] = order[j];
+      else order[i + rest_num++] = order[j];
+    }
+    memmove(order + i + lead_num, order + i, rest_num * sizeof(TraceEvent *));
+    memcpy(order + i, tmp, lead_num * sizeof(TraceEvent *));
+  }
+}
+
+static TraceEvent *read_trace(const char *path, size_t *num){
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  TraceHeader header;
+  if(fd < 0 || fstat(fd, &st) < 0 || read(fd, &header, sizeof(header)) != sizeof(header)){
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+  if(header.magic != TRACE_MAGIC || header.version != TRACE_VERSION || header.event_size != sizeof(TraceEvent)){
+    fprintf(stderr, "%s: not a trace of this version\n", path);
+    exit(EXIT_FAILURE);
+  }
+  *num = (st.st_size - sizeof(header)) / sizeof(TraceEvent);
+  TraceEvent *events = bench_mmap(*num * sizeof(TraceEvent));
+  char *data = (char *)events;
+  size_t left = *num * sizeof(TraceEvent);
+  while(left > 0){
+    ssize_t n = read(fd, data, left);
+    if(n <= 0){
+      perror(path);
+      exit(EXIT_FAILURE);
+    }
+    data += n;
+    left -= n;
+  }
+  close(fd);
+  return events;
+}
+
+// append op to the list of thread, the lists are sized by count first
+static ReplayOp *add_op(ReplayOp **lists, size_t *num, uint32_t thread, uint32_t op, uint64_t id, uint64_t size){
+  ReplayOp *r = NULL;
+  if(lists){
+    r = &lists[thread][num[thread]];
+    r->op = op;
+    r->id = id;
+    r->size = size;
+    r->step = objects[id].step++;
+  }
+  num[thread]++;
+  return r;
+}
+
+// two passes: count the ops of every thread, then fill them
+static size_t convert(TraceEvent **order, size_t num, ReplayOp **lists, size_t *op_num){
+  AddrMap map;
+  size_t cap = 16;
+  while(cap < num * 2) cap <<= 1;
+  map.addr = bench_mmap(cap * sizeof(uint64_t));
+  map.id = bench_mmap(cap * sizeof(uint64_t));
+  map.mask = cap - 1;
+  int64_t *pending = bench_mmap(thread_num * sizeof(int64_t)); // id of the realloc running
+  uint64_t *pending_addr = bench_mmap(thread_num * sizeof(uint64_t));
+  uint64_t next_id = 0;
+  memset(op_num, 0, thread_num * sizeof(size_t));
+  for(uint32_t t = 0; t < thread_num; t++){
+    pending[t] = -1;
+  }
+  for(size_t i = 0; i < num; i++){
+    TraceEvent *e = order[i];
+    uint32_t t = e->thread;
+    switch(e->op){
+      case TRACE_MALLOC:
+      case TRACE_CALLOC:
+      case TRACE_MEMALIGN:
+        if(e->ptr == 0) break;
+        map_take(&map, e->ptr);
+        map_put(&map, e->ptr, next_id);
+        add_op(lists, op_num, t, e->op, next_id++, e->size);
+        break;
+      case TRACE_FREE: {
+        int64_t id = map_take(&map, e->ptr);
+        if(id >= 0) add_op(lists, op_num, t, TRACE_FREE, id, 0);
+        break;
+      }
+      case TRACE_REALLOC_BEGIN:
+        pending[t] = e->ptr ? map_take(&map, e->ptr) : -1;
+        pending_addr[t] = e->ptr;
+        break;
+      case TRACE_REALLOC_END:
+        if(pending[t] < 0){
+          // realloc(NULL, size) or an object from before the trace: a new object
+          if(e->ptr == 0) break;
+          map_put(&map, e->ptr, next_id);
+          add_op(lists, op_num, t, TRACE_MALLOC, next_id++, e->size);
+        }else if(e->ptr == 0 && e->size == 0){
+          add_op(lists, op_num, t, TRACE_FREE, pending[t], 0);
+        }else if(e->ptr == 0){
+          map_put(&map, pending_addr[t], pending[t]); // failed, the old object is still there
+        }else{
+          map_put(&map, e->ptr, pending[t]);
+          add_op(lists, op_num, t, TRACE_REALLOC_END, pending[t], e->size);
+        }
+        pending[t] = -1;
+        break;
+    }
+  }
+  munmap(map.addr, cap * sizeof(uint64_t));
+  munmap(map.id, cap * sizeof(uint64_t));
+  munmap(pending, thread_num * sizeof(int64_t));
+  munmap(pending_addr, thread_num * sizeof(uint64_t));
+  return next_id;
+}
+
+/*
+*
+*  Replay
+*
+*/
+
+static void update_peak(){
+  long live = 0;
+  for(uint32_t i = 0; i < thread_num; i++){
+    live += atomic_load_explicit(&workers[i].live, memory_order_relaxed);
+  }
+  size_t heap = bench_footprint();
+  size_t cur_heap = atomic_load_explicit(&peak_heap, memory_order_relaxed);
+  while(cur_heap < heap && !atomic_compare_exchange_weak(&peak_heap, &cur_heap, heap));
+  long cur = atomic_load_explicit(&peak_live, memory_order_relaxed);
+  while(cur < live && !atomic_compare_exchange_weak(&peak_live, &cur, live));
+}
+
+static void add_live(Worker *w, long size){
+  atomic_store_explicit(&w->live, atomic_load_explicit(&w->live, memory_order_relaxed) + size, memory_order_relaxed);
+}
+
+static void *replay_thread(void *arg){
+  Worker *w = arg;
+  for(size_t i = 0; i < w->num; i++){
+    ReplayOp *r = &w->op[i];
+    Object *o = &objects[r->id];
+    if(r->step > 0){
+      while(atomic_load_explicit(&o->step, memory_order_acquire) != r->step){
+        sched_yield();
+      }
+    }
+    void *ptr = atomic_load_explicit(&o->ptr, memory_order_relaxed);
+    switch(r->op){
+      case TRACE_MALLOC:
+      case TRACE_MEMALIGN:
+        ptr = bench_malloc(r->size);
+        break;
+      case TRACE_CALLOC:
+        ptr = bench_malloc(r->size);
+        if(ptr) memset(ptr, 0, r->size);
+        break;
+      case TRACE_FREE:
+        bench_free(ptr);
+        ptr = NULL;
+        break;
+      case TRACE_REALLOC_END:
+        ptr = bench_realloc(ptr, r->size);
+        add_live(w, -(long)o->size);
+        break;
+    }
+    if(ptr == NULL && r->op != TRACE_FREE){
+      fprintf(stderr, "malloc(%lu) failed\n", (unsigned long)r->size);
+      exit(EXIT_FAILURE);
+    }
+    add_live(w, r->op == TRACE_FREE ? -(long)o->size : (long)r->size);
+    if(r->op != TRACE_FREE) o->size = r->size;
+    atomic_store_explicit(&o->ptr, ptr, memory_order_relaxed);
+    atomic_store_explicit(&o->step, r->step + 1, memory_order_release);
+    if(--w->check == 0){
+      w->check = CHECK_EVERY;
+      update_peak();
+    }
+  }
+  return NULL;
+}
+
+static const char *op_name(uint32_t op){
+  switch(op){
+    case TRACE_MALLOC: return "malloc";
+    case TRACE_CALLOC: return "calloc";
+    case TRACE_MEMALIGN: return "memalign";
+    case TRACE_FREE: return "free";
+    case TRACE_REALLOC_END: return "realloc";
+  }
+  return "?";
+}
+
+int main(int argc, char **argv){
+  int serial = 0, dump = 0, opt;
+  while((opt = getopt(argc, argv, "sd")) != -1){
+    switch(opt){
+      case 's': serial = 1; break;
+      case 'd': dump = 1; break;
+      default:
+        fprintf(stderr, "usage: %s <trace> [-s] [-d]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if(optind >= argc){
+    fprintf(stderr, "usage: %s <trace> [-s] [-d]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  const char *path = argv[optind];
+  size_t num;
+  TraceEvent *events = read_trace(path, &num);
+  TraceEvent **order = bench_mmap(num * sizeof(TraceEvent *));
+  TraceEvent **tmp = bench_mmap(num * sizeof(TraceEvent *));
+  for(size_t i = 0; i < num; i++){
+    order[i] = &events[i];
+  }
+  qsort(order, num, sizeof(TraceEvent *), cmp_event);
+  frees_first(order, num, tmp);
+  munmap(tmp, num * sizeof(TraceEvent *));
+  for(size_t i = 0; i < num; i++){
+    if(serial) events[i].thread = 0;
+    if(events[i].thread >= thread_num) thread_num = events[i].thread + 1;
+  }
+  if(thread_num == 0) thread_num = 1;
+
+  // count, then fill the ops of every thread
+  size_t *op_num = bench_mmap(thread_num * sizeof(size_t));
+  ReplayOp **lists = bench_mmap(thread_num * sizeof(ReplayOp *));
+  size_t object_num = convert(order, num, NULL, op_num);
+  objects = bench_mmap(object_num * sizeof(Object));
+  for(uint32_t t = 0; t < thread_num; t++){
+    lists[t] = bench_mmap(op_num[t] * sizeof(ReplayOp));
+  }
+  convert(order, num, lists, op_num);
+  munmap(order, num * sizeof(TraceEvent *));
+  munmap(events, num * sizeof(TraceEvent));
+  for(size_t i = 0; i < object_num; i++){
+    objects[i].step = 0;
+  }
+
+  size_t ops = 0;
+  for(uint32_t t = 0; t < thread_num; t++){
+    ops += op_num[t];
+  }
+  if(dump){
+    for(uint32_t t = 0; t < thread_num; t++){
+      for(size_t i = 0; i < op_num[t]; i++){
+        ReplayOp *r = &lists[t][i];
+        printf("%u %s %lu %lu\n", t, op_name(r->op), (unsigned long)r->id, (unsigned long)r->size);
+      }
+    }
+    return 0;
+  }
+
+  workers = bench_mmap(thread_num * sizeof(Worker));
+  pthread_t *tids = bench_mmap(thread_num * sizeof(pthread_t));
+  uint64_t start = now_ns();
+  for(uint32_t t = 0; t < thread_num; t++){
+    workers[t].op = lists[t];
+    workers[t].num = op_num[t];
+    workers[t].check = CHECK_EVERY;
+    pthread_create(&tids[t], NULL, replay_thread, &workers[t]);
+  }
+  for(uint32_t t = 0; t < thread_num; t++){
+    pthread_join(tids[t], NULL);
+  }
+  double seconds = (now_ns() - start) / 1e9;
+  update_peak();
+
+  size_t heap = atomic_load(&peak_heap);
+  long live = atomic_load(&peak_live);
+  printf("{\"alloc\":\"%s\",\"trace\":\"%s\",\"threads\":%u,\"objects\":%zu,\"ops\":%zu,"
+         "\"seconds\":%.6f,\"ops_per_sec\":%.0f,\"peak_heap\":%zu,\"peak_live\":%ld,\"fragmentation\":%.3f}\n",
+         ALLOC_NAME, path, thread_num, object_num, ops, seconds, seconds > 0 ? ops / seconds : 0.0,
+         heap, live, live > 0 ? (double)heap / live : 0.0);
+  return 0;
+}
@@ -0,0 +1,82 @@
+#include "my_malloc.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+/**
+ * @brief malloc latency against the length of the free list
+ *
+ * every round frees more small blocks which cannot be coalesced (each one is
+ * guarded by an allocated block, and grows in size so that the blocks freed
+ * in earlier rounds are not reused), then measures the average time of mallocs
+ * which cannot be served by those small blocks. Every malloc is timed, so the
+ * p999 and the worst one of the round are printed beside the average. Trimming
+ * is off, the csapp version does not trim.
+ *
+ * usage: ./bench_freelist [ff|bf|tlsf] (no tlsf in bench_freelist_csapp)
+ */
+
+#define SMALL_SIZE 264 // above SLAB_MAX, so bf_malloc takes them from the heap
+#define LARGE_SIZE 2000
+#define ROUNDS 8
+#define STEP 8000 // free blocks added each round
+#define LARGE_NUM 10000 // mallocs measured each round, enough that p999 is not the worst one
+
+static double now_ns(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b){
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv){
+  const char *name = argc > 1 ? argv[1] : "ff";
+  void *(*f_malloc)(size_t) = ff_malloc;
+  void (*f_free)(void *) = ff_free;
+  if(strcmp(name, "bf") == 0){
+    f_malloc = bf_malloc;
+    f_free = bf_free;
+  }
+#ifndef CSAPP_VERSION
+  else if(strcmp(name, "tlsf") == 0){
+    f_malloc = tlsf_malloc;
+    f_free = tlsf_free;
+  }
+  // the large blocks freed at the end of a round would be trimmed and sbrk'd again by the next one
+  set_trim_threshold((size_t)-1);
+#endif
+  static void *large[LARGE_NUM];
+  static void *small[STEP];
+  static double lat[LARGE_NUM];
+  size_t free_blocks = 0;
+
+  printf("%-12s %-12s %-12s %-12s\n", "free_blocks", "ns/malloc", "p999_ns", "max_ns");
+  for(int round = 0; round < ROUNDS; round++){
+    for(int i = 0; i < STEP; i++){
+      small[i] = f_malloc(SMALL_SIZE + round * 8);
+      f_malloc(SMALL_SIZE); // guard, never freed
+    }
+    for(int i = 0; i < STEP; i++){
+      f_free(small[i]);
+    }
+    free_blocks += STEP;
+
+    double cost = 0;
+    for(int i = 0; i < LARGE_NUM; i++){
+      double start = now_ns();
+      large[i] = f_malloc(LARGE_SIZE);
+      lat[i] = now_ns() - start;
+      cost += lat[i];
+    }
+    for(int i = 0; i < LARGE_NUM; i++){
+      f_free(large[i]);
+    }
+    qsort(lat, LARGE_NUM, sizeof(double), cmp_double);
+    printf("%-12zu %-12.1f %-12.0f %-12.0f\n", free_blocks, cost / LARGE_NUM,
+           lat[LARGE_NUM * 999 / 1000], lat[LARGE_NUM - 1]);
+  }
+  return 0;
+}
@@ -1,32 +1,57 @@
+#define _GNU_SOURCE // mremap
 #include "my_malloc.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <sys/mman.h>
 /**
  * @brief my simple version malloc libary
  * 
  * Creator: Yifan(Eva) Lin
  * NetId: yl734
  *  
- * tracking free block method: one level explicit free lists, insert block to list with LIFO
+ * tracking free block method: one level explicit free lists, insert block to list with LIFO,
+ * the same blocks are indexed by a size tree (treap keyed by size and address) for best fit.
+ * nf_malloc searches the list from a roving pointer (next fit), ao_malloc keeps the list in
+ * address order instead of LIFO (address-ordered first fit).
+ * blocks too small to hold the tree links are kept in one list per size instead.
+ * tlsf_malloc indexes the free blocks by two-level segregated lists (TLSF) instead, found with
+ * bitmaps in O(1), the blocks move between the two indexes when the other strategy is called.
  * 
- * data structure of an available block:
+ * header: one word PACK(size, flags), size is a multiple of DSIZE, flags in the low 3 bits
+ *
+ * data structure of an available block: the links and the footer live in its payload
  *                  free Metadata address
  *                          ^
  *                          | 
- *     | size | is_alloc | prev | next | **other data** | footer(tail) |  
- *                                  |        |
- *                                  |        v
- *                                  v       payload
+ *     | header(size | UNALLOC) | next | prev | left | right | **other data** | footer(tail) |  
+ *                                 |                   
+ *                                 v        payload (size bytes, >= MIN_SIZE)
  *                        free  Metadata address 
+ * left / right: children in the size tree, only for size >= TREE_MIN_SIZE
  * 
+ * allocated block: only the header, the payload takes the whole size
+ *     | header(size | ALLOC(|PREV_FREE)) | payload ... |
+ * PREV_FREE tells that the block before is free, only then its footer is read
+ *
+ * large block (size >= mmap_threshold): own mapping, flags = MMAPPED, never in free list
+ *     | header(size | MMAPPED) | payload ... | (rest of last page)
+ *
+ * small block of bf_malloc (size <= SLAB_MAX): object without header in a span, a heap block
+ * of SPAN_SIZE starting at a page, cut into objects of one size class
+ *     | header(SPAN_SIZE | ALLOC) | Span | object | object | ... |
+ *                                 ^ page, page_map maps every page of the span to its Span
+ *
+ * deferred coalescing (set_defer_coalescing): a freed block <= QUICK_MAX keeps its header as
+ * allocated and waits in the quick list of its exact size, so neighbours do not coalesce with it
+ *     | header(size | ALLOC(|PREV_FREE)) | next | ... |
+ *
  * reference: based on csapp & cmu15213
  * TODO:
- *    1. replace Metadata(size, is_alloc) == > Metadata(header)  header= PACK(size, is_alloc)
- *    2. remove the footer in allocated block ==> TAG in next block's header 
- *    3. one list ==> multi-level size explict list
- *    4. reallocate function
+ *    1. one list ==> multi-level size explict list
  */
 
 
@@ -39,71 +64,151 @@
 #define GET(p)  (*(size_t *)(p))
 #define PUT(p, val)  (*(size_t *)(p) = (val))
 #define PACK(size, is_alloc)  ((size)|(is_alloc))
-#define GET_SIZE(p)  (GET(p) & ~0x1) 
+#define FLAGS 0x7 // low bits of header and footer
+#define GET_SIZE(p)  (GET(p) & ~FLAGS) 
 #define GET_ALLOC(p) (GET(p) & 0x1)
+#define GET_FLAGS(p) (GET(p) & FLAGS)
+#define SET_SIZE(p, size) PUT(p, PACK(size, GET_FLAGS(p)))
+#define SET_FLAGS(p, flags) PUT(p, PACK(GET_SIZE(p), flags))
 #define UNALLOC 1
 #define ALLOC 0
 #define TAIL_SIZE (sizeof(size_t))
+#define HEAD_SIZE (sizeof(size_t)) // the header is all an allocated block carries
+#define MIN_SIZE (2 * sizeof(void *) + TAIL_SIZE) // payload of a free block holds the links and footer
+#define TREE_MIN_SIZE (4 * sizeof(void *) + TAIL_SIZE) // free block in the size tree also holds left / right
+#define SMALL_NUM ((TREE_MIN_SIZE - MIN_SIZE) / DSIZE) // lists of free blocks too small for the tree
+#define SMALL_INDEX(size) (((size) - MIN_SIZE) / DSIZE)
+#define MMAPPED 2 // flags of block in its own mapping
+#define PREV_FREE 4 // flag of an allocated block: the block before it is free
+#define MMAP_THRESHOLD (128 * 1024) // default threshold of mmap block
+#define TRIM_THRESHOLD (256 * 1024) // free block at the top larger than it is given back to os
+#define TRIM_PAD (64 * 1024) // free space kept at the top after trimming
+#define NEXT_BLOCK(p) ((void*)(p) + HEAD_SIZE + GET_SIZE(p)) // where the next block starts
+#define TLSF_SL_LOG2 4 // second level: 16 lists for every power of two
+#define TLSF_SL_NUM (1 << TLSF_SL_LOG2)
+#define TLSF_FL_SHIFT (TLSF_SL_LOG2 + 3) // sizes below 1 << TLSF_FL_SHIFT are first level 0, one list per DSIZE
+#define TLSF_FL_NUM (sizeof(size_t) * 8 - TLSF_FL_SHIFT + 1)
+#define FLS(size) ((int)(sizeof(size_t) * 8) - 1 - __builtin_clzl(size)) // index of the highest bit set
+#define SLAB_MAX 256 // bf_malloc size <= SLAB_MAX is an object of a span
+#define SLAB_ALIGN 16 // size classes of slab are SLAB_ALIGN apart
+#define SLAB_CLASS_NUM (SLAB_MAX / SLAB_ALIGN)
+#define SLAB_CLASS(size) ((size) <= SLAB_ALIGN ? 0 : ((size) - 1) / SLAB_ALIGN)
+#define MAP_PAGE_SHIFT 12 // page of page map, spans start at it
+#define MAP_PAGE ((size_t)1 << MAP_PAGE_SHIFT)
+#define SPAN_SIZE (4 * MAP_PAGE)
+#define MAP_BITS 12 // page map has 3 levels, each one takes MAP_BITS bits of the page number
+#define MAP_NODE (1 << MAP_BITS)
+#define SIZED_SLACK 128 // a block may be this much larger than its size: the tail too small to split stays in it
+#define QUICK_MAX 1024 // with deferred coalescing a freed block <= QUICK_MAX waits in the quick list of its size
+#define QUICK_NUM (QUICK_MAX / DSIZE + 1)
 
+// next and prev are valid only when the block is free, they are the payload otherwise
 struct metadata {
-  size_t size;
-  size_t is_alloc;
+  size_t header;
   struct metadata * next;
   struct metadata * prev;
+  struct metadata * left; // size tree, free block >= TREE_MIN_SIZE only
+  struct metadata * right;
 };
 typedef struct metadata Metadata;
 
+// the start of a span, the objects follow it
+struct span {
+  struct span * next; // spans of the class with free objects
+  struct span * prev;
+  void * free_list; // freed objects, chained by their first word
+  char * unused; // objects from here to end are never used
+  char * end;
+  size_t size; // object size
+  size_t used; // objects in use
+};
+typedef struct span Span;
+
 // static function signature
 static void * reuse_block(size_t size, Metadata * p);
 static void * allocate_block(size_t size);
 static void* my_sbrk(size_t size);
 static void remove_block(Metadata * p);
 static void set_tail(Metadata *p);
+static void set_prev_free(void *next, size_t prev_free);
 static void add_block_to_head(Metadata *p);
-static void coalesc_tail(Metadata *p);
+static Metadata * coalesc_tail(Metadata *p);
+static size_t trim_top(Metadata *p, size_t pad);
+static void * mmap_block(size_t size);
+static void munmap_block(Metadata *p);
+static void * mremap_block(Metadata *p, size_t size);
+static int resize_block(Metadata *p, size_t size);
+static void * quick_malloc(size_t size);
+static void coalesce_block(Metadata *p);
+static int consolidate(void);
 
 Metadata * first_free_block = NULL; // free block list header
 Metadata * last_free_block = NULL; // free block list tail
+Metadata * free_tree = NULL; // root of size tree, the same blocks as free block list
+Metadata * small_free[SMALL_NUM]; // free blocks < TREE_MIN_SIZE, one list per size
 size_t data_size = 0;  // record allocated data
 size_t free_size = 0; // record available data
 void *begin = NULL; //use to check invalid address
+void *top = NULL; // end of the last block, sbrk(0) can be moved by others
+void *brk_high = NULL; // the highest break we have seen, memory above it is fresh from os
+int sbrk_fresh = 0; // if memory from the last my_sbrk is fresh from os (all zero)
+void *fresh_block = NULL; // payload of the last block made of fresh memory
+size_t top_prev_free = 0; // PREV_FREE if the block ending at top is free
 size_t op = 0; // debug
+size_t mmap_threshold = MMAP_THRESHOLD; // malloc size >= threshold use mmap
+size_t mmap_block_num = 0; // record mmap blocks in use
+size_t mmap_size = 0; // record mmap data
+size_t trim_threshold = TRIM_THRESHOLD;
+int tlsf_index = 0; // free blocks are in the TLSF lists instead of the list / tree / small lists
+uint64_t tlsf_fl_bitmap = 0; // bit fl set if any list of first level fl is not empty
+uint32_t tlsf_sl_bitmap[TLSF_FL_NUM]; // bit sl set if tlsf_lists[fl][sl] is not empty
+Metadata * tlsf_lists[TLSF_FL_NUM][TLSF_SL_NUM];
+Span * slab_spans[SLAB_CLASS_NUM]; // spans with free objects of every size class
+void * page_map[MAP_NODE]; // page number -> Span, nodes of the lower levels are mmaped
+Metadata * rover = NULL; // next fit goes on from this block of the free list, NULL from the head
+int address_order = 0; // the free list is kept in address order (ao_malloc) instead of LIFO
+unsigned long search_steps = 0; // blocks of the free list and nodes of the size tree visited by malloc
+Metadata * quick_free[QUICK_NUM]; // freed blocks not coalesced yet, one list per size, linked by next
+size_t quick_size = 0; // bytes in quick lists (with headers)
+size_t quick_limit = 0; // more bytes than it in quick lists are coalesced, 0 coalesces every free at once
 
-// function to do alignment, unnessary in this experiment
+// function to do alignment, keep the low bits of size for the flags,
+// and room for the links and footer when the block is free
 static size_t align(size_t size){
+  if(size < MIN_SIZE) size = MIN_SIZE;
   return (size+DSIZE-1) / DSIZE * DSIZE;
 }
 
-// set the footer for block
+// set the footer for free block, in the last word of its payload
 static void set_tail(Metadata *p){
-  size_t size = p->size;
-  size_t is_alloc = p->is_alloc;
-  void *tail_ptr = (void*)p + size + sizeof(Metadata);
-  PUT(tail_ptr, PACK(size, is_alloc));
+  void *tail_ptr = NEXT_BLOCK(p) - TAIL_SIZE;
+  PUT(tail_ptr, PACK(GET_SIZE(p), UNALLOC));
+}
+
+// tell the block starting at next (or the one which will start at top) if the block before it is free
+static void set_prev_free(void *next, size_t prev_free){
+  if(next == top){
+    top_prev_free = prev_free;
+    return;
+  }
+  SET_FLAGS(next, (GET_FLAGS(next) & ~PREV_FREE) | prev_free);
 }
 
 // reuse previous block
 static void * reuse_block(size_t size, Metadata * p) {
-  if (p->size - size >= sizeof(Metadata)+DSIZE+TAIL_SIZE) {
-    Metadata * remain = (Metadata *)((char *)p + sizeof(Metadata) + size+TAIL_SIZE);
-    remain->size = p->size - size - sizeof(Metadata)-TAIL_SIZE;
-    remain->is_alloc = UNALLOC;
-    remain->next = p->next;
-    if(p == last_free_block){
-      last_free_block = remain;
-    }else{
-      if(p->next) p->next->prev = remain;
-    }
-    p->next = remain;
-    remain->prev = p;
-    p->size = size; 
+  remove_block(p); // before the size of p changes
+  if (GET_SIZE(p) - size >= HEAD_SIZE+MIN_SIZE) {
+    Metadata * remain = (Metadata *)((char *)p + HEAD_SIZE + size);
+    PUT(remain, PACK(GET_SIZE(p) - size - HEAD_SIZE, UNALLOC));
+    PUT(p, PACK(size, ALLOC)); // the block before a free block is never free
     set_tail(remain);
+    add_block_to_head(remain);
+  }else{
+    set_prev_free(NEXT_BLOCK(p), 0);
+    SET_FLAGS(p, ALLOC);
   }
-  free_size -= p->size + sizeof(Metadata)+TAIL_SIZE;
-  remove_block(p);
-  p->is_alloc = ALLOC;
-  set_tail(p);
-  return (char *)p + sizeof(Metadata);
+  free_size -= GET_SIZE(p) + HEAD_SIZE;
+  return (char *)p + HEAD_SIZE;
 }
 
 // wrapper sbrk function to record allocated data
@@ -111,6 +216,9 @@ static void* my_sbrk(size_t size){
   void *res = sbrk(size);
   if(res != (void*)-1){
     data_size += size;
+    top = res + size;
+    sbrk_fresh = res >= brk_high;
+    if(top > brk_high) brk_high = top;
     return res;
   }
   return NULL;
@@ -118,20 +226,219 @@ static void* my_sbrk(size_t size){
 
 // expend heap size to create new block
 static void * allocate_block(size_t size) {
-  Metadata * new_block = my_sbrk(size + sizeof(Metadata)+TAIL_SIZE);
+  void *old_top = top;
+  Metadata * new_block = my_sbrk(size + HEAD_SIZE);
   if(new_block == NULL){
     return NULL;
   }
-  new_block->size = size;
-  new_block->is_alloc = ALLOC;
-  new_block->prev = NULL;
-  new_block->next = NULL;
-  set_tail(new_block);
-  return (void *)new_block + sizeof(Metadata);
+  // the break may be moved by others, then the block before is not ours
+  PUT(new_block, PACK(size, ALLOC | ((void*)new_block == old_top ? top_prev_free : 0)));
+  top_prev_free = 0;
+  if(sbrk_fresh) fresh_block = (void *)new_block + HEAD_SIZE;
+  return (void *)new_block + HEAD_SIZE;
+}
+
+/*
+*
+*  Size tree: a treap keyed by (size, address), the priority is a hash of the address,
+*  so it stays balanced without any field for it. Lookup, insert and remove are O(log n).
+*
+*/
+
+// priority of node p, parents have higher priority than children
+static uintptr_t tree_priority(Metadata *p){
+  return (uintptr_t)p * 0x9E3779B97F4A7C15ull;
+}
+
+// if a is before b in (size, address) order
+static int tree_less(Metadata *a, Metadata *b){
+  return GET_SIZE(a) < GET_SIZE(b) || (GET_SIZE(a) == GET_SIZE(b) && a < b);
+}
+
+// insert p into the tree at root, return the new root
+static Metadata * tree_insert(Metadata *root, Metadata *p){
+  if(root == NULL){
+    p->left = NULL;
+    p->right = NULL;
+    return p;
+  }
+  if(tree_less(p, root)){
+    root->left = tree_insert(root->left, p);
+    if(tree_priority(root->left) > tree_priority(root)){
+      Metadata *l = root->left; // rotate right
+      root->left = l->right;
+      l->right = root;
+      return l;
+    }
+  }else{
+    root->right = tree_insert(root->right, p);
+    if(tree_priority(root->right) > tree_priority(root)){
+      Metadata *r = root->right; // rotate left
+      root->right = r->left;
+      r->left = root;
+      return r;
+    }
+  }
+  return root;
 }
 
-// add availble block as head of free block list
+// join two trees, all nodes of a are before the nodes of b
+static Metadata * tree_join(Metadata *a, Metadata *b){
+  if(a == NULL) return b;
+  if(b == NULL) return a;
+  if(tree_priority(a) > tree_priority(b)){
+    a->right = tree_join(a->right, b);
+    return a;
+  }
+  b->left = tree_join(a, b->left);
+  return b;
+}
+
+// remove p from the tree at root, return the new root
+static Metadata * tree_remove(Metadata *root, Metadata *p){
+  if(root == NULL) return NULL;
+  if(root == p) return tree_join(p->left, p->right);
+  if(tree_less(p, root)){
+    root->left = tree_remove(root->left, p);
+  }else{
+    root->right = tree_remove(root->right, p);
+  }
+  return root;
+}
+
+// the smallest block not smaller than size, the lowest address among equal sizes
+static Metadata * tree_best_fit(Metadata *root, size_t size){
+  Metadata *best = NULL;
+  while(root){
+    search_steps++;
+    if(GET_SIZE(root) >= size){
+      best = root;
+      root = root->left;
+    }else{
+      root = root->right;
+    }
+  }
+  return best;
+}
+
+// the first block in the lists of small blocks which can hold size
+static Metadata * small_fit(size_t size){
+  if(size >= TREE_MIN_SIZE) return NULL;
+  for(size_t i = SMALL_INDEX(size); i < SMALL_NUM; i++){
+    if(small_free[i]) return small_free[i];
+  }
+  return NULL;
+}
+
+/*
+*
+*  TLSF: first level list is the power of two of the size, second level splits it into
+*  TLSF_SL_NUM lists, a bitmap on each level tells the lists which are not empty.
+*
+*/
+
+// first / second level list of a free block of size
+static void tlsf_mapping(size_t size, int *fl, int *sl){
+  if(size < ((size_t)1 << TLSF_FL_SHIFT)){
+    *fl = 0;
+    *sl = size / DSIZE;
+  }else{
+    int log2 = FLS(size);
+    *fl = log2 - TLSF_FL_SHIFT + 1;
+    *sl = (size >> (log2 - TLSF_SL_LOG2)) ^ TLSF_SL_NUM;
+  }
+}
+
+static void tlsf_insert(Metadata *p){
+  int fl, sl;
+  tlsf_mapping(GET_SIZE(p), &fl, &sl);
+  Metadata **head = &tlsf_lists[fl][sl];
+  p->next = *head;
+  p->prev = NULL;
+  if(*head) (*head)->prev = p;
+  *head = p;
+  tlsf_fl_bitmap |= (uint64_t)1 << fl;
+  tlsf_sl_bitmap[fl] |= 1u << sl;
+}
+
+// its size must be the one it is inserted with
+static void tlsf_remove(Metadata *p){
+  int fl, sl;
+  tlsf_mapping(GET_SIZE(p), &fl, &sl);
+  if(p->next) p->next->prev = p->prev;
+  if(p->prev){
+    p->prev->next = p->next;
+    return;
+  }
+  tlsf_lists[fl][sl] = p->next;
+  if(p->next == NULL){
+    tlsf_sl_bitmap[fl] &= ~(1u << sl);
+    if(tlsf_sl_bitmap[fl] == 0) tlsf_fl_bitmap &= ~((uint64_t)1 << fl);
+  }
+}
+
+// a free block not smaller than size without any search: size is rounded up to the next
+// list first, so the head of the first non empty list from there always fits
+static Metadata * tlsf_fit(size_t size){
+  if(size >= ((size_t)1 << TLSF_FL_SHIFT)){
+    size_t round = ((size_t)1 << (FLS(size) - TLSF_SL_LOG2)) - 1;
+    if(size + round < size) return NULL;
+    size += round;
+  }
+  int fl, sl;
+  tlsf_mapping(size, &fl, &sl);
+  uint32_t sl_map = tlsf_sl_bitmap[fl] & (~0u << sl);
+  if(sl_map == 0){
+    uint64_t fl_map = tlsf_fl_bitmap & (~(uint64_t)0 << (fl + 1));
+    if(fl_map == 0) return NULL;
+    fl = __builtin_ctzll(fl_map);
+    sl_map = tlsf_sl_bitmap[fl];
+  }
+  return tlsf_lists[fl][__builtin_ctz(sl_map)];
+}
+
+// insert p into the free list ordered by address, walking from both ends at once
+static void add_block_by_address(Metadata *p){
+  Metadata *prev = NULL;
+  if(p > last_free_block){
+    prev = last_free_block;
+  }else if(p > first_free_block){
+    Metadata *next = last_free_block;
+    prev = first_free_block;
+    while(prev->next < p && next->prev > p){
+      prev = prev->next;
+      next = next->prev;
+    }
+    if(prev->next < p) prev = next->prev; // found from the tail
+  }
+  p->prev = prev;
+  p->next = prev ? prev->next : first_free_block;
+  if(p->next) p->next->prev = p;
+  else last_free_block = p;
+  if(prev) prev->next = p;
+  else first_free_block = p;
+}
+
+// add availble block as head of free block list (and into the size tree), at its address
+// in address order, or as head of the list of its size if it is too small for the tree
 static void add_block_to_head(Metadata *p){
+  if(tlsf_index){
+    tlsf_insert(p);
+    return;
+  }
+  if(GET_SIZE(p) < TREE_MIN_SIZE){
+    Metadata **head = &small_free[SMALL_INDEX(GET_SIZE(p))];
+    p->next = *head;
+    p->prev = NULL;
+    if(*head) (*head)->prev = p;
+    *head = p;
+    return;
+  }
+  free_tree = tree_insert(free_tree, p);
+  if(address_order && first_free_block){
+    add_block_by_address(p);
+    return;
+  }
   if(!first_free_block){
     first_free_block = p;
     last_free_block = p;
@@ -145,8 +452,20 @@ static void add_block_to_head(Metadata *p){
   first_free_block = p;
 }
 
-// remove the block
+// remove the block, its size must be the one it is added with
 static void remove_block(Metadata * p) {
+  if(tlsf_index){
+    tlsf_remove(p);
+    return;
+  }
+  if(GET_SIZE(p) < TREE_MIN_SIZE){
+    if(p->next) p->next->prev = p->prev;
+    if(p->prev) p->prev->next = p->next;
+    else small_free[SMALL_INDEX(GET_SIZE(p))] = p->next;
+    return;
+  }
+  free_tree = tree_remove(free_tree, p);
+  if(rover == p) rover = p->next; // the block after p is where next fit goes on
   if(first_free_block == p){
     first_free_block = p->next; // if p is last node, p->next = NULL
     if(p == last_free_block) last_free_block = NULL;
@@ -161,77 +480,651 @@ static void remove_block(Metadata * p) {
   p->prev = NULL;
 }
 
-// use footer to coalesc block with previous one and next one
-static void coalesc_tail(Metadata *p){
-  if(!p) return;
-  if((void*)p + sizeof(Metadata) + p->size+TAIL_SIZE < sbrk(0)){
-    Metadata *pnext = (Metadata*)((void*)p + sizeof(Metadata) + p->size+TAIL_SIZE);
-    if(pnext->is_alloc == UNALLOC){
-      p->size += sizeof(Metadata) + pnext->size + TAIL_SIZE;
+// index the free blocks by the TLSF lists (tlsf = 1) or by the list / tree / small lists,
+// the blocks already free move to the new index, only when ff / bf and tlsf are mixed
+static void use_index(int tlsf){
+  if(tlsf_index == tlsf) return;
+  Metadata *moved = NULL; // chained by next
+  if(tlsf_index){
+    while(tlsf_fl_bitmap){
+      int fl = __builtin_ctzll(tlsf_fl_bitmap);
+      Metadata *p = tlsf_lists[fl][__builtin_ctz(tlsf_sl_bitmap[fl])];
+      tlsf_remove(p);
+      p->next = moved;
+      moved = p;
+    }
+  }else{
+    for(size_t i = 0; i <= SMALL_NUM; i++){
+      Metadata **head = i < SMALL_NUM ? &small_free[i] : &first_free_block;
+      while(*head){
+        Metadata *p = *head;
+        remove_block(p);
+        p->next = moved;
+        moved = p;
+      }
+    }
+  }
+  tlsf_index = tlsf;
+  while(moved){
+    Metadata *p = moved;
+    moved = p->next;
+    add_block_to_head(p);
+  }
+}
+
+// sort a list of blocks linked by next by address (merge sort)
+static Metadata * sort_blocks(Metadata *list){
+  if(list == NULL || list->next == NULL) return list;
+  Metadata *slow = list, *fast = list->next;
+  while(fast && fast->next){
+    slow = slow->next;
+    fast = fast->next->next;
+  }
+  Metadata *half = slow->next;
+  slow->next = NULL;
+  Metadata *a = sort_blocks(list), *b = sort_blocks(half);
+  Metadata head, *tail = &head;
+  while(a && b){
+    Metadata **min = a < b ? &a : &b;
+    tail->next = *min;
+    tail = *min;
+    *min = (*min)->next;
+  }
+  tail->next = a ? a : b;
+  return head.next;
+}
+
+// keep the free list in address order (address = 1) or LIFO, the list is sorted once when
+// ao_malloc is called after the others
+static void use_order(int address){
+  if(address_order == address) return;
+  address_order = address;
+  if(!address || first_free_block == NULL) return;
+  first_free_block = sort_blocks(first_free_block);
+  Metadata *prev = NULL;
+  for(Metadata *p = first_free_block; p; p = p->next){
+    p->prev = prev;
+    prev = p;
+  }
+  last_free_block = prev;
+}
+
+// coalesc free block with previous one and next one, add the coalesced block to free list and return it
+// p is not in free list yet, the footer of previous block is read only if p is tagged PREV_FREE
+static Metadata * coalesc_tail(Metadata *p){
+  if(!p) return NULL;
+  if(NEXT_BLOCK(p) != top){
+    Metadata *pnext = (Metadata*)NEXT_BLOCK(p);
+    if(GET_FLAGS(pnext) == UNALLOC){
+      SET_SIZE(p, GET_SIZE(p) + HEAD_SIZE + GET_SIZE(pnext));
       remove_block(pnext);
-      set_tail(p);
     }
   }
-  void *prev_tail = (void *)p - TAIL_SIZE;
-  if(prev_tail > begin && prev_tail - GET_SIZE(prev_tail) - sizeof(Metadata) > begin){
-    if (GET_ALLOC(prev_tail) == UNALLOC){
-      Metadata *pprev = (Metadata*)(prev_tail - GET_SIZE(prev_tail) - sizeof(Metadata));
-      pprev->size += sizeof(Metadata) + TAIL_SIZE + p->size;
-      set_tail(pprev);
-      remove_block(p);
+  if(GET_FLAGS(p) & PREV_FREE){
+    void *prev_tail = (void *)p - TAIL_SIZE;
+    Metadata *pprev = (Metadata*)((void *)p - GET_SIZE(prev_tail) - HEAD_SIZE);
+    remove_block(pprev); // before its size changes
+    SET_SIZE(pprev, GET_SIZE(pprev) + HEAD_SIZE + GET_SIZE(p));
+    p = pprev;
+  }
+  SET_FLAGS(p, UNALLOC);
+  set_tail(p);
+  set_prev_free(NEXT_BLOCK(p), PREV_FREE);
+  add_block_to_head(p);
+  return p;
+}
+
+// give the free block at the top of heap back to os, keep pad bytes of it
+static size_t trim_top(Metadata *p, size_t pad){
+  void *end = NEXT_BLOCK(p);
+  if(GET_FLAGS(p) != UNALLOC || end != top || end != sbrk(0)) return 0;
+  size_t release = HEAD_SIZE + GET_SIZE(p);
+  pad = pad > 0 ? align(pad) : 0;
+  if(pad > 0 && GET_SIZE(p) > pad){
+    release = GET_SIZE(p) - pad; // keep the block with a smaller size
+  }else if(pad > 0){
+    return 0;
+  }
+  if(release == HEAD_SIZE + GET_SIZE(p)){
+    remove_block(p); // before the memory of p is gone
+    top_prev_free = 0; // the block before a free block is never free
+  }else{
+    remove_block(p);
+    SET_SIZE(p, pad);
+    set_tail(p);
+    add_block_to_head(p);
+  }
+  sbrk(-(intptr_t)release);
+  data_size -= release;
+  free_size -= release;
+  top -= release;
+  return release;
+}
+
+// length of the mapping holding block with size
+static size_t mmap_length(size_t size){
+  size_t page = sysconf(_SC_PAGESIZE);
+  return (size + HEAD_SIZE + page - 1) / page * page;
+}
+
+// put large block in its own mapping, so it can be given back to os when free
+static void * mmap_block(size_t size) {
+  size = align(size); // keep the low bits for the flags
+  size_t length = mmap_length(size);
+  Metadata * new_block = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(new_block == MAP_FAILED){
+    return NULL;
+  }
+  PUT(new_block, PACK(size, MMAPPED));
+  mmap_block_num += 1;
+  mmap_size += length;
+  fresh_block = (void *)new_block + HEAD_SIZE;
+  return (void *)new_block + HEAD_SIZE;
+}
+
+static void munmap_block(Metadata *p){
+  size_t length = mmap_length(GET_SIZE(p));
+  mmap_block_num -= 1;
+  mmap_size -= length;
+  munmap(p, length);
+}
+
+// resize the mapping, the kernel moves the pages rather than copy them
+static void * mremap_block(Metadata *p, size_t size){
+  size = align(size);
+  size_t old_length = mmap_length(GET_SIZE(p));
+  size_t length = mmap_length(size);
+  if(length != old_length){
+    p = mremap(p, old_length, length, MREMAP_MAYMOVE);
+    if(p == MAP_FAILED){
+      return NULL;
+    }
+    mmap_size += length - old_length;
+  }
+  SET_SIZE(p, size);
+  return (void *)p + HEAD_SIZE;
+}
+
+// resize the block without moving it, return 0 if the next block cannot give enough space
+static int resize_block(Metadata *p, size_t size){
+  if(size > GET_SIZE(p)){
+    void *next = NEXT_BLOCK(p);
+    if(next == top && next == sbrk(0)){
+      // the block is at the top of heap, move the break
+      if(my_sbrk(size - GET_SIZE(p)) == NULL) return 0;
+      SET_SIZE(p, size);
+      return 1;
     }
+    if(next == top) return 0;
+    Metadata *pnext = (Metadata*)next;
+    if(GET_FLAGS(pnext) != UNALLOC || GET_SIZE(p) + HEAD_SIZE + GET_SIZE(pnext) < size) return 0;
+    remove_block(pnext);
+    free_size -= HEAD_SIZE + GET_SIZE(pnext);
+    SET_SIZE(p, GET_SIZE(p) + HEAD_SIZE + GET_SIZE(pnext));
+    set_prev_free(NEXT_BLOCK(p), 0);
+  }
+  // split the tail off as reuse_block does
+  size_t remain_size = GET_SIZE(p) - size;
+  if(remain_size < HEAD_SIZE+MIN_SIZE){
+    return 1;
   }
+  SET_SIZE(p, size);
+  Metadata * remain = (Metadata *)NEXT_BLOCK(p);
+  PUT(remain, PACK(remain_size - HEAD_SIZE, UNALLOC));
+  free_size += remain_size;
+  coalesc_tail(remain);
+  return 1;
+}
+
+// best fit block from the heap, without slab and mmap
+static void * best_fit_block(size_t size){
+  if(begin == NULL) begin = sbrk(0);
+  use_index(0);
+  size = align(size);
+  void *res = quick_malloc(size);
+  if(res) return res;
+  Metadata * best;
+  do{
+    best = small_fit(size);
+    if (best == NULL) best = tree_best_fit(free_tree, size);
+  }while(best == NULL && consolidate());
+  if (best) {
+    return reuse_block(size, best);
+  }
+  else {
+    return allocate_block(size);
+  }
+}
+
+/*
+*
+*  Slab: a span is cut into objects of one size class, which carry no header. The page map
+*  finds the span of an object from its address alone.
+*
+*/
+
+// heap block of size whose payload starts at a page, the space in front of it is freed
+static void * page_block(size_t size){
+  void *ptr = best_fit_block(size + MAP_PAGE + HEAD_SIZE + MIN_SIZE);
+  if(ptr == NULL) return NULL;
+  if((uintptr_t)ptr % MAP_PAGE){
+    Metadata *p = (Metadata *)((char *)ptr - HEAD_SIZE);
+    char *aligned = (char *)(((uintptr_t)ptr + HEAD_SIZE + MIN_SIZE + MAP_PAGE - 1) / MAP_PAGE * MAP_PAGE);
+    Metadata *q = (Metadata *)(aligned - HEAD_SIZE);
+    PUT(q, PACK((char *)NEXT_BLOCK(p) - aligned, ALLOC));
+    PUT(p, PACK((char *)q - (char *)ptr, UNALLOC | (GET_FLAGS(p) & PREV_FREE)));
+    free_size += GET_SIZE(p) + HEAD_SIZE;
+    coalesc_tail(p);
+    ptr = aligned;
+  }
+  resize_block((Metadata *)((char *)ptr - HEAD_SIZE), size); // split the tail off
+  return ptr;
+}
+
+// slot of page map for page, the nodes on the way are made if create, NULL if there is none
+static Span ** page_slot(uintptr_t page, int create){
+  if(page >> (3 * MAP_BITS)) return NULL;
+  void **node = &page_map[page >> (2 * MAP_BITS)];
+  for(int level = 1; level >= 0; level--){
+    if(*node == NULL){
+      if(!create) return NULL;
+      void *res = mmap(NULL, MAP_NODE * sizeof(void *), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if(res == MAP_FAILED) return NULL;
+      *node = res;
+    }
+    node = (void **)*node + ((page >> (level * MAP_BITS)) & (MAP_NODE - 1));
+  }
+  return (Span **)node;
+}
+
+// the span holding ptr, NULL if ptr is not an object of slab
+static Span * span_of(void *ptr){
+  Span **slot = page_slot((uintptr_t)ptr >> MAP_PAGE_SHIFT, 0);
+  return slot ? *slot : NULL;
+}
+
+// map every page of span s to value, return 0 if page map cannot hold it
+static int map_span(Span *s, Span *value){
+  uintptr_t first = (uintptr_t)s >> MAP_PAGE_SHIFT;
+  for(uintptr_t page = first; page < first + SPAN_SIZE / MAP_PAGE; page++){
+    if(page_slot(page, 1) == NULL) return 0;
+  }
+  for(uintptr_t page = first; page < first + SPAN_SIZE / MAP_PAGE; page++){
+    *page_slot(page, 0) = value;
+  }
+  return 1;
+}
+
+static void add_span(Span *s, int c){
+  s->prev = NULL;
+  s->next = slab_spans[c];
+  if(s->next) s->next->prev = s;
+  slab_spans[c] = s;
+}
+
+static void remove_span(Span *s, int c){
+  if(s->next) s->next->prev = s->prev;
+  if(s->prev) s->prev->next = s->next;
+  else slab_spans[c] = s->next;
+}
+
+static int span_full(Span *s){
+  return s->free_list == NULL && s->unused + s->size > s->end;
+}
+
+static Span * new_span(int c){
+  Span *s = page_block(SPAN_SIZE);
+  if(s == NULL) return NULL;
+  if(!map_span(s, s)){
+    bf_free(s);
+    return NULL;
+  }
+  s->free_list = NULL;
+  s->unused = (char *)s + (sizeof(Span) + SLAB_ALIGN - 1) / SLAB_ALIGN * SLAB_ALIGN;
+  s->end = (char *)s + SPAN_SIZE;
+  s->size = (c + 1) * SLAB_ALIGN;
+  s->used = 0;
+  add_span(s, c);
+  return s;
+}
+
+// an object of the size class of size, taken from the freed ones first, NULL if no span can be made
+static void * slab_malloc(size_t size){
+  int c = SLAB_CLASS(size);
+  Span *s = slab_spans[c];
+  if(s == NULL && (s = new_span(c)) == NULL) return NULL;
+  void *obj = s->free_list;
+  if(obj){
+    s->free_list = *(void **)obj;
+  }else{
+    obj = s->unused;
+    s->unused += s->size;
+  }
+  s->used++;
+  if(span_full(s)) remove_span(s, c);
+  return obj;
+}
+
+// free ptr if it is an object of slab, return 0 if it is not. An empty span goes back to
+// the heap unless it is the only one left of its class
+static int slab_free(void *ptr){
+  Span *s = span_of(ptr);
+  if(s == NULL) return 0;
+  int c = SLAB_CLASS(s->size);
+  if(span_full(s)) add_span(s, c);
+  *(void **)ptr = s->free_list;
+  s->free_list = ptr;
+  s->used--;
+  if(s->used == 0 && (slab_spans[c] != s || s->next != NULL)){
+    remove_span(s, c);
+    map_span(s, NULL);
+    bf_free(s);
+  }
+  return 1;
+}
+
+// calloc with the given malloc strategy, memory fresh from os is already zero
+static void * calloc_block(size_t num, size_t size, void *(*malloc_fn)(size_t)){
+  if(size && num > SIZE_MAX / size) return NULL;
+  fresh_block = NULL;
+  void *res = malloc_fn(num * size);
+  if(res && res != fresh_block) memset(res, 0, num * size);
+  return res;
+}
+
+// realloc with the given malloc / free strategy, copy only when the block cannot be resized in place
+static void * realloc_block(void *ptr, size_t size, void *(*malloc_fn)(size_t), void (*free_fn)(void *)){
+  if(ptr == NULL) return malloc_fn(size);
+  if(size == 0){
+    free_fn(ptr);
+    return NULL;
+  }
+  Span * s = span_of(ptr);
+  if(s){
+    if(size <= s->size) return ptr;
+    void *res = malloc_fn(size);
+    if(res == NULL) return NULL;
+    memcpy(res, ptr, s->size);
+    free_fn(ptr);
+    return res;
+  }
+  Metadata * p = (Metadata *)((char *)ptr - HEAD_SIZE);
+  if(GET_FLAGS(p) == MMAPPED){
+    if(size >= mmap_threshold) return mremap_block(p, size);
+  }else if(resize_block(p, align(size))){
+    return ptr;
+  }
+  void *res = malloc_fn(size);
+  if(res == NULL) return NULL;
+  memcpy(res, ptr, GET_SIZE(p) < size ? GET_SIZE(p) : size);
+  free_fn(ptr);
+  return res;
+}
+
+/*
+*
+*  Deferred coalescing: freeing and mallocing the same size over and over merges a block with its
+*  neighbours and splits it again every time. A freed block waits in the quick list of its exact
+*  size instead and is given out again as it is. The quick lists are coalesced all at once when a
+*  malloc finds no free block, or when they hold more than quick_limit bytes (as fastbins of dlmalloc).
+*
+*/
+
+// coalesce a freed block with its neighbours, a large block at the top of heap is trimmed
+static void coalesce_block(Metadata *p){
+  SET_FLAGS(p, UNALLOC | (GET_FLAGS(p) & PREV_FREE));
+  p = coalesc_tail(p);
+  if(GET_SIZE(p) >= trim_threshold) trim_top(p, TRIM_PAD);
+}
+
+// a block of the quick list of size (aligned), NULL if it is empty
+static void * quick_malloc(size_t size){
+  if(size > QUICK_MAX || quick_free[size / DSIZE] == NULL) return NULL;
+  Metadata *p = quick_free[size / DSIZE];
+  quick_free[size / DSIZE] = p->next;
+  quick_size -= GET_SIZE(p) + HEAD_SIZE;
+  free_size -= GET_SIZE(p) + HEAD_SIZE;
+  return (char *)p + HEAD_SIZE;
+}
+
+// coalesce every block of the quick lists, return 0 if they are empty
+static int consolidate(void){
+  if(quick_size == 0) return 0;
+  for(int i = 0; i < QUICK_NUM; i++){
+    while(quick_free[i]){
+      Metadata *p = quick_free[i];
+      quick_free[i] = p->next;
+      coalesce_block(p);
+    }
+  }
+  quick_size = 0;
+  return 1;
 }
 
 
 /** user function **/
 
-void * ff_malloc(size_t size) {
-  if(begin == NULL) begin = sbrk(0);
+// the first block of the free list not smaller than size
+static Metadata * first_fit(size_t size){
   Metadata * p = first_free_block;
-  while (p && p->size < size) p = p->next;
+  while (p && GET_SIZE(p) < size){
+    search_steps++;
+    p = p->next;
+  }
+  if(p) search_steps++;
+  return p;
+}
+
+// the first block not smaller than size from rover on, the search wraps around to the head
+// and stops at rover. rover moves behind the block when it is removed from the list
+static Metadata * next_fit(size_t size){
+  Metadata *start = rover ? rover : first_free_block;
+  for(Metadata *p = start; p; p = p->next){
+    search_steps++;
+    if(GET_SIZE(p) >= size){
+      rover = p;
+      return p;
+    }
+  }
+  for(Metadata *p = first_free_block; p != start; p = p->next){
+    search_steps++;
+    if(GET_SIZE(p) >= size){
+      rover = p;
+      return p;
+    }
+  }
+  return NULL;
+}
+
+// malloc with the free list searched by fit, the list is in address order if address
+static void * list_malloc(size_t size, Metadata *(*fit)(size_t), int address){
+  if(size >= mmap_threshold) return mmap_block(size);
+  if(begin == NULL) begin = sbrk(0);
+  use_order(address);
+  use_index(0);
+  size = align(size);
+  void *res = quick_malloc(size);
+  if(res) return res;
+  Metadata * p;
+  do{
+    p = small_fit(size);
+    if(p == NULL) p = fit(size);
+  }while(p == NULL && consolidate());
   if(p) return reuse_block(size, p);
   return allocate_block(size);
 }
 
+void * ff_malloc(size_t size) {
+  return list_malloc(size, first_fit, 0);
+}
+
+
+// free a block which is no object of slab, with deferred coalescing a small one waits in its quick list
+static void free_block(void * ptr) {
+  Metadata * p = (Metadata *)((char *)ptr - HEAD_SIZE);
+  if(GET_FLAGS(p) == MMAPPED){
+    munmap_block(p);
+    return;
+  }
+  free_size += GET_SIZE(p) + HEAD_SIZE;
+  if(quick_limit && GET_SIZE(p) <= QUICK_MAX){
+    Metadata **head = &quick_free[GET_SIZE(p) / DSIZE];
+    p->next = *head;
+    *head = p;
+    quick_size += GET_SIZE(p) + HEAD_SIZE;
+    if(quick_size > quick_limit) consolidate();
+    return;
+  }
+  coalesce_block(p);
+}
 
 void ff_free(void * ptr) {
-  Metadata * p = (Metadata *)((char *)ptr - sizeof(Metadata));
-  p->is_alloc = UNALLOC;
-  free_size += p->size + sizeof(Metadata)+TAIL_SIZE;
-  set_tail(p);
-  add_block_to_head(p);
-  coalesc_tail(p);
+  if(ptr == NULL || slab_free(ptr)) return;
+  free_block(ptr);
+}
+
+#ifdef MY_MALLOC_DEBUG
+// abort if size cannot be the size the block of ptr is malloced with
+static void check_size(void *ptr, size_t size){
+  Span *s = span_of(ptr);
+  size_t usable = s ? s->size : GET_SIZE((char *)ptr - HEAD_SIZE);
+  int fits = s ? SLAB_CLASS(size) == SLAB_CLASS(s->size) : size <= usable && usable - size < SIZED_SLACK;
+  if(!fits){
+    fprintf(stderr, "my_malloc: sized free of %p with size %zu, the block holds %zu bytes\n", ptr, size, usable);
+    abort();
+  }
+}
+#endif
+
+// free with the size the block is malloced with: a block larger than SLAB_MAX is no object of slab,
+// so the page map is not walked. Built with -DMY_MALLOC_DEBUG the size is checked against the block
+static void free_sized(void * ptr, size_t size) {
+  if(ptr == NULL) return;
+#ifdef MY_MALLOC_DEBUG
+  check_size(ptr, size);
+#endif
+  if(size <= SLAB_MAX && slab_free(ptr)) return;
+  free_block(ptr);
 }
 
+// small size is served by slab, in O(1) and without header
 void * bf_malloc(size_t size) {
-  if(begin == NULL) begin = sbrk(0);
-  Metadata * p = first_free_block;
-  Metadata * best = NULL;
-  while (p != NULL) {
-    if (p->size >= size) {
-      if ((!best) || (p->size < best->size)) {
-        best = p;
-        // the threshold of inner fragment < DSIZE 
-        if(best->size-size < DSIZE){ 
-            break; // use immediately
-        }
-      }
-    }
-    p = p->next;
+  if(size <= SLAB_MAX){
+    void *res = slab_malloc(size);
+    if(res) return res;
   }
-  if (best) {
-    return reuse_block(size, best);
+  if(size >= mmap_threshold) return mmap_block(size);
+  return best_fit_block(size);
+}
+
+void bf_free(void * ptr) {
+  return ff_free(ptr);
+}
+
+// the same as bf_malloc, but takes a block of the first TLSF list which surely fits rather
+// than the best one, every step is O(1)
+void * tlsf_malloc(size_t size) {
+  if(size >= mmap_threshold) return mmap_block(size);
+  if(begin == NULL) begin = sbrk(0);
+  use_index(1);
+  size = align(size);
+  void *res = quick_malloc(size);
+  if(res) return res;
+  Metadata * p;
+  do{
+    p = tlsf_fit(size);
+  }while(p == NULL && consolidate());
+  if (p) {
+    return reuse_block(size, p);
   }
   else {
     return allocate_block(size);
   }
 }
 
-void bf_free(void * ptr) {
+void tlsf_free(void * ptr) {
+  return ff_free(ptr);
+}
+
+// first fit going on from where the last search stopped, so the small blocks piling up at the
+// head of the LIFO list are not walked by every malloc
+void * nf_malloc(size_t size) {
+  return list_malloc(size, next_fit, 0);
+}
+
+void nf_free(void * ptr) {
   return ff_free(ptr);
 }
 
+// first fit on the free list ordered by address, a free walks the list to its place
+void * ao_malloc(size_t size) {
+  return list_malloc(size, first_fit, 1);
+}
+
+void ao_free(void * ptr) {
+  return ff_free(ptr);
+}
+
+void ff_free_sized(void * ptr, size_t size) {
+  free_sized(ptr, size);
+}
+
+void bf_free_sized(void * ptr, size_t size) {
+  free_sized(ptr, size);
+}
+
+void tlsf_free_sized(void * ptr, size_t size) {
+  free_sized(ptr, size);
+}
+
+void nf_free_sized(void * ptr, size_t size) {
+  free_sized(ptr, size);
+}
+
+void ao_free_sized(void * ptr, size_t size) {
+  free_sized(ptr, size);
+}
+
+void * ff_realloc(void * ptr, size_t size) {
+  return realloc_block(ptr, size, ff_malloc, ff_free);
+}
+
+void * bf_realloc(void * ptr, size_t size) {
+  return realloc_block(ptr, size, bf_malloc, bf_free);
+}
+
+void * tlsf_realloc(void * ptr, size_t size) {
+  return realloc_block(ptr, size, tlsf_malloc, tlsf_free);
+}
+
+void * nf_realloc(void * ptr, size_t size) {
+  return realloc_block(ptr, size, nf_malloc, nf_free);
+}
+
+void * ao_realloc(void * ptr, size_t size) {
+  return realloc_block(ptr, size, ao_malloc, ao_free);
+}
+
+void * ff_calloc(size_t num, size_t size) {
+  return calloc_block(num, size, ff_malloc);
+}
+
+void * bf_calloc(size_t num, size_t size) {
+  return calloc_block(num, size, bf_malloc);
+}
+
+void * tlsf_calloc(size_t num, size_t size) {
+  return calloc_block(num, size, tlsf_malloc);
+}
+
+void * nf_calloc(size_t num, size_t size) {
+  return calloc_block(num, size, nf_malloc);
+}
+
+void * ao_calloc(size_t num, size_t size) {
+  return calloc_block(num, size, ao_malloc);
+}
+
 unsigned long get_data_segment_size() {
   return data_size;
 }
@@ -239,3 +1132,41 @@ unsigned long get_data_segment_size() {
 unsigned long get_data_segment_free_space_size() {
   return free_size;
 }
+
+// trim the free block at the top of heap until only pad bytes left, return 1 if any memory is released
+int my_malloc_trim(size_t pad) {
+  consolidate();
+  if(top == NULL || top <= begin || top != sbrk(0) || !top_prev_free) return 0;
+  void *tail = top - TAIL_SIZE;
+  Metadata *p = (Metadata *)(top - GET_SIZE(tail) - HEAD_SIZE);
+  return trim_top(p, pad) > 0;
+}
+
+void set_trim_threshold(size_t threshold) {
+  trim_threshold = threshold;
+}
+
+void set_defer_coalescing(size_t limit) {
+  quick_limit = limit;
+  if(limit == 0) consolidate();
+}
+
+void set_mmap_threshold(size_t threshold) {
+  mmap_threshold = threshold;
+}
+
+unsigned long get_mmap_threshold() {
+  return mmap_threshold;
+}
+
+unsigned long get_mmap_block_num() {
+  return mmap_block_num;
+}
+
+unsigned long get_mmap_size() {
+  return mmap_size;
+}
+
+unsigned long get_search_steps() {
+  return search_steps;
+}
@@ -8,12 +8,66 @@
 void *ff_malloc(size_t size);
 void ff_free(void *ptr);
 
-// Best Fit malloc / free
+// Best Fit malloc / free, size <= 256 is an object of a slab without header (my_malloc.c only)
 void *bf_malloc(size_t size);
 void bf_free(void *ptr);
 
+// TLSF malloc / free: O(1) malloc and free with bounded fragmentation (my_malloc.c only),
+// calling it moves the free blocks of ff / bf to its own index and back when they are called
+void *tlsf_malloc(size_t size);
+void tlsf_free(void *ptr);
+
+// Next Fit malloc / free: first fit going on from where the last search stopped (my_malloc.c only)
+void *nf_malloc(size_t size);
+void nf_free(void *ptr);
+
+// Address-Ordered first fit malloc / free: the free list is kept in address order instead of LIFO,
+// so a free walks the list to its place (my_malloc.c only)
+void *ao_malloc(size_t size);
+void ao_free(void *ptr);
+
+// free with the size given to malloc (C23 free_sized), a block larger than 256 bytes skips the slab lookup,
+// -DMY_MALLOC_DEBUG aborts if size does not match the block (my_malloc.c only)
+void ff_free_sized(void *ptr, size_t size);
+void bf_free_sized(void *ptr, size_t size);
+void tlsf_free_sized(void *ptr, size_t size);
+void nf_free_sized(void *ptr, size_t size);
+void ao_free_sized(void *ptr, size_t size);
+
+// realloc grows / shrinks the block in place when possible, large block in its own mapping grows with mremap
+// calloc only zeroes memory not fresh from os
+void *ff_realloc(void *ptr, size_t size); // (my_malloc.c only)
+void *bf_realloc(void *ptr, size_t size); // (my_malloc.c only)
+void *tlsf_realloc(void *ptr, size_t size); // (my_malloc.c only)
+void *nf_realloc(void *ptr, size_t size); // (my_malloc.c only)
+void *ao_realloc(void *ptr, size_t size); // (my_malloc.c only)
+void *ff_calloc(size_t num, size_t size); // (my_malloc.c only)
+void *bf_calloc(size_t num, size_t size); // (my_malloc.c only)
+void *tlsf_calloc(size_t num, size_t size); // (my_malloc.c only)
+void *nf_calloc(size_t num, size_t size); // (my_malloc.c only)
+void *ao_calloc(size_t num, size_t size); // (my_malloc.c only)
+
 unsigned long get_data_segment_size(); //in bytes
 unsigned long get_data_segment_free_space_size(); //in bytes
 
+// give the free space at the top of heap back to os until pad bytes left, return 1 if memory released
+int my_malloc_trim(size_t pad); // (my_malloc.c only)
+// a free block at the top of heap larger than threshold is trimmed when free (my_malloc.c only)
+void set_trim_threshold(size_t threshold);
+
+// deferred coalescing: a freed block up to 1024 bytes is kept by its exact size for the next malloc of it
+// and coalesced only when a malloc finds no free block or more than limit bytes wait, 0 turns it off
+// (default) and coalesces the waiting blocks
+void set_defer_coalescing(size_t limit);
+
+// malloc size >= threshold is served by its own mmap mapping (my_malloc.c only)
+void set_mmap_threshold(size_t threshold);
+unsigned long get_mmap_threshold(); //in bytes
+unsigned long get_mmap_block_num(); //mapped blocks in use
+unsigned long get_mmap_size(); //in bytes
+
+// blocks of the free list and nodes of the size tree visited by all mallocs so far (my_malloc.c only)
+unsigned long get_search_steps();
+
 
 #endif
@@ -1,25 +1,41 @@
 #include "my_malloc.h"
+#include <unistd.h>
 /**
  * @brief my malloc lib
- * 
+ *
  * Creator: Yifan(Eva) Lin
  * NetId: yl734
- *  
+ *
  * tracking free block method: multi-level explicit free lists, insert block to list with LIFO
- * 
+ *
  * data structure of an available block:
  *               other block playload address
  *                  ^
- *                  | 
- *     | header | prev | next | **other data** | footer |  
+ *                  |
+ *     | header | next | prev | **other data** | footer |
  *              |          |
  *              bp         v
  *                       other block payload address
- * 
+ *
+ * data structure of an allocated block (no footer):
+ *
+ *     | header | payload ... |
+ *              |
+ *              bp
+ *
+ * header = PACK(size, PREV_ALLOC | is_alloc), PREV_ALLOC tells that the previous block is allocated,
+ * the footer of the previous block is read only when it is not set
+ *
+ * segregated lists: list i keeps the blocks whose size is in (MINSIZE<<(i-1), MINSIZE<<i],
+ *                   the last list keeps all the larger blocks
+ *
+ * deferred coalescing (set_defer_coalescing): a freed block <= QUICK_MAX keeps its header as
+ * allocated and waits in the quick list of its exact size, linked by next, so neighbours do not
+ * coalesce with it
+ *
  * reference: based on csapp & cmu15213
  * TODO:
- *    1. remove the footer in allocated block with TAG in next block's header
- *    2. realloc function
+ *    1. realloc function
  */
 
 
@@ -28,15 +44,17 @@
 */
 
 #define WSIZE sizeof(char*)  //linux:1 word = 4 bytes, extendable alteration when system change
-#define DSIZE WSIZE * 2
-#define OVERHEAD WSIZE * 2 // header + footer + prev + next
-#define MINSIZE DSIZE
+#define DSIZE (WSIZE * 2)
+#define OVERHEAD WSIZE // header, allocated block has no footer
+#define MINSIZE (DSIZE * 2) // header + next + prev + footer
 
 #define GET(p)  (*(size_t *)(p))
-#define PUT(p, val)  (*(size_t *)(p) = (val))
+#define PUT(p, val)  (*(size_t *)(p) = (size_t)(val))
 #define PACK(size, is_alloc)  ((size)|(is_alloc))
-#define GET_SIZE(p)  (GET(p) & ~0x7) 
+#define GET_SIZE(p)  (GET(p) & ~0x7)
 #define GET_ALLOC(p) (GET(p) & 0x1)
+#define PREV_ALLOC 0x2 // in header: the previous block is allocated
+#define GET_PREV_ALLOC(p) (GET(p) & PREV_ALLOC)
 
 
 // get header and footer
@@ -44,71 +62,91 @@
 #define FTRP(bp) ((char*)(bp) + GET_SIZE(HDRP(bp)) - 2*WSIZE) // get footer address from payload address
 #define GET_BP_SIZE(bp) (GET_SIZE(HDRP(bp)))
 #define GET_BP_ALLOC(bp) (GET_ALLOC(HDRP(bp)))
+#define GET_BP_PREV_ALLOC(bp) (GET_PREV_ALLOC(HDRP(bp)))
 
 
 
-// get physical prev and next address of bp
+// get physical prev and next address of bp, PRED only when the previous block is free
 #define PRED(bp)  ((char*)(bp)- GET_SIZE((char*)(bp) - DSIZE))
 #define NEXT(bp)  ((char*)(bp) + GET_BP_SIZE(bp))
 
 // get free list prev and next address of bp
-#define LIST_PREV_PTR(bp) ((char*)(bp)+WSIZE) 
+#define LIST_PREV_PTR(bp) ((char*)(bp)+WSIZE)
 #define LIST_NEXT_PTR(bp) ((char*)(bp))
-#define LIST_PREV_BLK(bp) (GET(LIST_PREV_PTR(bp)))
-#define LIST_NEXT_BLK(bp) (GET(LIST_NEXT_PTR(bp)))
+#define LIST_PREV_BLK(bp) ((void*)GET(LIST_PREV_PTR(bp)))
+#define LIST_NEXT_BLK(bp) ((void*)GET(LIST_NEXT_PTR(bp)))
 
 #define ALLOC 1
 #define UNALLOC 0
 
 // mulit-level heap_list config
-#define HEAP_LIST_NUM 1
+#define HEAP_LIST_NUM 20 // the last list starts at MINSIZE << 18 (8 MB)
+#define QUICK_MAX 1024 // with deferred coalescing a freed block <= QUICK_MAX waits in the quick list of its size
+#define QUICK_NUM (QUICK_MAX / WSIZE + 1)
 
 // shortcut
-// #define ALGIN(size) ()
+#define ALIGN(size) (((size) + WSIZE - 1) / WSIZE * WSIZE)
 #define SET_HEADER(bp, size, alloc)  (PUT(HDRP(bp), PACK(size, alloc)))
 #define SET_FOOTER(bp, size, alloc)  (PUT(FTRP(bp), PACK(size, alloc)))
 #define SET_TAIL_EXTENDED(bp) (PUT(HDRP(NEXT(bp)), PACK(0, ALLOC)))
+#define SET_NEXT_PREV_ALLOC(bp) (PUT(HDRP(NEXT(bp)), GET(HDRP(NEXT(bp))) | PREV_ALLOC))
+#define CLEAR_NEXT_PREV_ALLOC(bp) (PUT(HDRP(NEXT(bp)), GET(HDRP(NEXT(bp))) & ~PREV_ALLOC))
 #define SET_LIST_PREV(bp, prev)  (PUT(LIST_PREV_PTR(bp), prev))
 #define SET_LIST_NEXT(bp, next)  (PUT(LIST_NEXT_PTR(bp), next))
 
 
 /*internal function*/
 // consistent function
-// static int mm_init(); // initialize all config
-static int mm_init_single_list(); // initialize single list to debug
-static void *extend_heap(size_t words); // allocate memory from os and move the break
+static int mm_init(); // initialize all config
+static void *extend_heap(size_t size); // allocate memory from os and move the break
 static void *coalesce_imme(void *bp); // coalesce immediately when free block
-// static void *split(void *bp, size_t size); // split a block to two blocks
 static void used(void *bp, size_t size); // occupy the block and set it used
 static int is_valid_free(void *bp); // check if the bp is allocated and not out of bound
 static void* my_sbrk(size_t size);
 static void remove_from_list(void *bp); // remove the block from available list
 static void insert_block_FIFO(void *bp);
+static int get_list_index(size_t size); // get the list which the block size belongs to
+static void *quick_malloc(size_t size); // a block of the quick list of size
+static int consolidate(); // coalesce the blocks of all quick lists
 
 
 // status variable
 size_t data_size = 0;  // counting allocated data, avoid unnecessary time cost
 size_t free_size = 0;  // counting available data, avoid nunecessary time cost
-static char *heap_listp = NULL; // the start of heap pointer
+static char *heap_listp = NULL; // the start of heap pointer (payload of prologue block)
+static void *seg_listp[HEAP_LIST_NUM]; // the head of each size class list
+static void *quick_listp[QUICK_NUM]; // freed blocks not coalesced yet, one list per size
+static size_t quick_size = 0; // bytes in quick lists
+static size_t quick_limit = 0; // more bytes than it in quick lists are coalesced, 0 coalesces every free at once
 
 // implement internal functions
 
-// do size merge and set header, footer 
+// size class of a block: 0 for MINSIZE, then one class for every power of two
+static int get_list_index(size_t size){
+  if(size <= MINSIZE) return 0;
+  int index = (int)(sizeof(size_t) * 8 - 1 - __builtin_clzl(size - 1)) - __builtin_ctzl(MINSIZE) + 1;
+  return index < HEAP_LIST_NUM ? index : HEAP_LIST_NUM - 1;
+}
+
+// do size merge and set header, footer, the footer of previous block is read only when it is free
 static void *coalesce_imme(void *bp){
-  void *prev = PRED(bp);
   void *next = NEXT(bp);
   size_t cur_size = GET_BP_SIZE(bp);
+  size_t prev_alloc = GET_BP_PREV_ALLOC(bp);
   if(GET_BP_ALLOC(next) == UNALLOC){
     cur_size += GET_BP_SIZE(next);
     remove_from_list(next);
   }
-  if(GET_BP_ALLOC(prev) == UNALLOC){
+  if(!prev_alloc){
+    void *prev = PRED(bp);
     cur_size += GET_BP_SIZE(prev);
     remove_from_list(prev);
+    prev_alloc = GET_BP_PREV_ALLOC(prev);
     bp = prev;
   }
-  SET_HEADER(bp, cur_size, UNALLOC);
+  SET_HEADER(bp, cur_size, UNALLOC | prev_alloc);
   SET_FOOTER(bp, cur_size, UNALLOC);
+  CLEAR_NEXT_PREV_ALLOC(bp);
   return bp;
 }
 
@@ -121,34 +159,33 @@ static void *my_sbrk(size_t size){
   return res;
 }
 
-static int mm_init_single_list(){
+// | padding | prologue header | prologue footer | epilogue header |
+static int mm_init(){
   if((heap_listp = my_sbrk(4 * WSIZE))==(void*)-1){
+    heap_listp = NULL;
     return -1;
   }
-  // PUT(heap_listp, NULL); // start pointer 
-  PUT(heap_listp+0*WSIZE, PACK(DSIZE, ALLOC));
-  PUT(heap_listp+1*WSIZE, PACK(DSIZE, ALLOC));
-  PUT(heap_listp+2*WSIZE, NULL); // next
-  PUT(heap_listp+3*WSIZE,PACK(0, ALLOC));
+  PUT(heap_listp, 0);
+  PUT(heap_listp+1*WSIZE, PACK(DSIZE, ALLOC | PREV_ALLOC));
+  PUT(heap_listp+2*WSIZE, PACK(DSIZE, ALLOC));
+  PUT(heap_listp+3*WSIZE, PACK(0, ALLOC | PREV_ALLOC));
   heap_listp += 2 * WSIZE;
-  // heap_listp += 4 * WSIZE; // remove the heap_listp to the data start pointer
+  for(int i = 0; i < HEAP_LIST_NUM; i++){
+    seg_listp[i] = NULL;
+  }
   return 0;
 }
 
 static void *extend_heap(size_t size){
-  size_t asize = (size + DSIZE-1)/DSIZE * DSIZE;
-  // size_t word = size / WSIZE;
-  // size_t asize = words&1 ?(words+1)*WSIZE:words*WSIZE; 
+  size_t asize = ALIGN(size);
   void *p;
-  if((p == my_sbrk(asize)) == (void*)-1){
+  if((p = my_sbrk(asize)) == (void*)-1){
     perror("alloc error");
     return NULL;
   }
-  // current block == tail + sbrk
-  SET_HEADER(p, asize, UNALLOC);
+  // current block == tail + sbrk, the old epilogue tells if the block before is allocated
+  SET_HEADER(p, asize, UNALLOC | GET_BP_PREV_ALLOC(p));
   SET_FOOTER(p, asize, UNALLOC);
-  SET_LIST_NEXT(p, NULL);
-  SET_LIST_PREV(p, NULL);
   SET_TAIL_EXTENDED(p);
   // coalesce with previous segment
   p = coalesce_imme(p);
@@ -156,92 +193,110 @@ static void *extend_heap(size_t size){
   return p;
 }
 
+// insert the block to the head of its size class list
 static void insert_block_FIFO(void *p){
-  if(!heap_listp){
-    heap_listp = p;
-    SET_LIST_NEXT(p, NULL);
-  }
-  else{
-    SET_LIST_NEXT(p, LIST_NEXT_BLK(heap_listp));
-    SET_LIST_PREV(p, heap_listp);
-    SET_LIST_PREV(LIST_NEXT_BLK(heap_listp), p);
-    SET_LIST_NEXT(heap_listp, p);
+  int index = get_list_index(GET_BP_SIZE(p));
+  void *head = seg_listp[index];
+  SET_LIST_PREV(p, NULL);
+  SET_LIST_NEXT(p, head);
+  if(head){
+    SET_LIST_PREV(head, p);
   }
+  seg_listp[index] = p;
 }
 
 static int is_valid_free(void *bp){
-  if((heap_listp != NULL)&&(bp > heap_listp && bp < sbrk(0))&&(GET_BP_ALLOC(bp) == ALLOC)){
-    return 0;
+  if((heap_listp != NULL)&&((char*)bp > heap_listp && bp < sbrk(0))&&(GET_BP_ALLOC(bp) == ALLOC)){
+    return 1;
   }
-  return -1;
+  return 0;
 }
 
+// the size in header must still be the one used when inserting
 static void remove_from_list(void *bp){
     void *prev = LIST_PREV_BLK(bp);
     void *next = LIST_NEXT_BLK(bp);
     if(prev){
           SET_LIST_NEXT(prev, next);
+    }else{
+          seg_listp[get_list_index(GET_BP_SIZE(bp))] = next;
     }
     if(next){
-        SET_LIST_PREV(next, prev);  
+        SET_LIST_PREV(next, prev);
     }
     SET_LIST_PREV(bp, NULL);
     SET_LIST_NEXT(bp, NULL);
 }
 
-static void insert_list_after(void *bp, void *prev){
-  if(prev == NULL){
-    return; 
-  }
-  void *next = LIST_NEXT_BLK(prev);
-  SET_LIST_PREV(bp, prev);
-  SET_LIST_NEXT(bp, next);
-  SET_LIST_NEXT(prev, bp);
-  if(next){
-    SET_LIST_PREV(next, bp);
-  }
-}
-
 static void used(void *bp, size_t size){
   size_t remain = GET_BP_SIZE(bp) - size;
+  remove_from_list(bp);
   if(remain >= MINSIZE){
     // need split the block
-    void *rpt = bp + size + WSIZE;
-    SET_HEADER(rpt, remain, UNALLOC);
+    void *rpt = (char*)bp + size;
+    SET_HEADER(rpt, remain, UNALLOC | PREV_ALLOC);
     SET_FOOTER(rpt, remain, UNALLOC);
-    insert_list_after(rpt, bp);
+    insert_block_FIFO(rpt);
+    SET_HEADER(bp, size, ALLOC | GET_BP_PREV_ALLOC(bp));
   }else{
     size = GET_BP_SIZE(bp);
+    SET_HEADER(bp, size, ALLOC | GET_BP_PREV_ALLOC(bp));
+    SET_NEXT_PREV_ALLOC(bp);
   }
-  remove_from_list(bp);
-  SET_HEADER(bp, size, ALLOC);
-  SET_FOOTER(bp, size, ALLOC);
   free_size -= size;
 }
 
+// block size needed for the user size: header + payload, a free block needs MINSIZE
+static size_t adjust_size(size_t size){
+  if(size <= MINSIZE - OVERHEAD) return MINSIZE;
+  return ALIGN(size + OVERHEAD);
+}
+
+// deferred coalescing: a freed block waits in the quick list of its exact size and is given out
+// again as it is, the quick lists are coalesced all at once when a malloc finds no free block,
+// or when they hold more than quick_limit bytes
+static void *quick_malloc(size_t size){
+  if(size > QUICK_MAX || quick_listp[size / WSIZE] == NULL) return NULL;
+  void *bp = quick_listp[size / WSIZE];
+  quick_listp[size / WSIZE] = LIST_NEXT_BLK(bp);
+  quick_size -= size;
+  free_size -= size;
+  return bp;
+}
+
+// return 0 if the quick lists are empty
+static int consolidate(){
+  if(quick_size == 0) return 0;
+  for(size_t i = 0; i < QUICK_NUM; i++){
+    while(quick_listp[i]){
+      void *bp = quick_listp[i];
+      quick_listp[i] = LIST_NEXT_BLK(bp);
+      insert_block_FIFO(coalesce_imme(bp));
+    }
+  }
+  quick_size = 0;
+  return 1;
+}
+
 // implement user function
 
 //First Fit malloc / free
 void *ff_malloc(size_t size){
   if(!size) return NULL;
-  if(!heap_listp) mm_init_single_list();
-  size_t asize = MINSIZE;
-  if(size > asize){
-      asize = (size + WSIZE*2 + WSIZE - 1)/WSIZE * WSIZE;
-  }
-  void *cur = GET(heap_listp);
-  int index = 0;
-  /*if multiple heap */
-  if(HEAP_LIST_NUM > 1){
-    // get the start pointer of list based on size
-  }
-  void *bp;
-  while(index < HEAP_LIST_NUM){
-    while(cur!= NULL && GET_BP_SIZE(cur) < asize){
-      cur = LIST_NEXT_BLK(cur);
+  if(!heap_listp && mm_init() == -1) return NULL;
+  size_t asize = adjust_size(size);
+  void *cur = quick_malloc(asize);
+  if(cur != NULL) return cur;
+  do{
+    // start from the first list which can hold asize, lists after it hold bigger blocks only
+    for(int index = get_list_index(asize); index < HEAP_LIST_NUM && cur == NULL; index++){
+      cur = seg_listp[index];
+      while(cur!= NULL && GET_BP_SIZE(cur) < asize){
+        cur = LIST_NEXT_BLK(cur);
+      }
     }
-    index += 1;
-  }
+  }while(cur == NULL && consolidate());
+  void *bp;
   if(cur != NULL){
     bp = cur;
   }else{
@@ -257,11 +312,20 @@ void *ff_malloc(size_t size){
 
 
 void ff_free(void *p){
+  if(p == NULL) return;
   if(!is_valid_free(p)){
       perror("free invalid ptr");
       exit(EXIT_FAILURE);
   }
-  free_size += GET_BP_SIZE(p);
+  size_t size = GET_BP_SIZE(p);
+  free_size += size;
+  if(quick_limit && size <= QUICK_MAX){
+    SET_LIST_NEXT(p, quick_listp[size / WSIZE]);
+    quick_listp[size / WSIZE] = p;
+    quick_size += size;
+    if(quick_size > quick_limit) consolidate();
+    return;
+  }
   p = coalesce_imme(p);
   insert_block_FIFO(p);
 }
@@ -269,27 +333,24 @@ void ff_free(void *p){
 
 void *bf_malloc(size_t size){
   if(!size) return NULL;
-  if(!heap_listp) mm_init_single_list();
-  size_t asize = MINSIZE;
-  if(size > asize){
-      asize = (size + WSIZE*2 + WSIZE - 1)/WSIZE * WSIZE;
-  }
-  void *cur = GET(heap_listp);
-  int index = 0;
-  /*if multiple heap */
-  if(HEAP_LIST_NUM > 1){
-    // get the start pointer of list based on size
-  }
-  void *bp = NULL;
-  while(index < HEAP_LIST_NUM){
-    while(cur!= NULL){
-      if(GET_BP_SIZE(cur) < asize && (bp == NULL || GET_BP_SIZE(cur)-asize < GET_BP_SIZE(bp)-asize)){
-        bp = cur;
+  if(!heap_listp && mm_init() == -1) return NULL;
+  size_t asize = adjust_size(size);
+  void *bp = quick_malloc(asize);
+  if(bp != NULL) return bp;
+  do{
+    // the best block is in the first non-empty list which has a suitable block
+    for(int index = get_list_index(asize); index < HEAP_LIST_NUM && bp == NULL; index++){
+      void *cur = seg_listp[index];
+      while(cur!= NULL){
+        if(GET_BP_SIZE(cur) >= asize && (bp == NULL || GET_BP_SIZE(cur) < GET_BP_SIZE(bp))){
+          bp = cur;
+          // the threshold of inner fragment < DSIZE
+          if(GET_BP_SIZE(bp) - asize < DSIZE) break;
+        }
+        cur = LIST_NEXT_BLK(cur);
       }
-      cur = LIST_NEXT_BLK(cur);
     }
-    index += 1;
-  }
+  }while(bp == NULL && consolidate());
   if(bp == NULL){
     // cannot find a suitable block, extend heap size
     bp = extend_heap(asize);
@@ -312,4 +373,7 @@ unsigned long get_data_segment_free_space_size(){
     return free_size;
 }
 
-
+void set_defer_coalescing(size_t limit){
+  quick_limit = limit;
+  if(limit == 0) consolidate();
+}
@@ -1,8 +1,20 @@
+#define _GNU_SOURCE // mremap
 #include "my_malloc.h"
+#include "my_malloc_trace.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <math.h>
+#include <execinfo.h>
+#include <sys/mman.h>
 
 #define With_sbk_lock 1
 #define No_sbk_lock 0
@@ -11,442 +23,2733 @@
 #define GET(p)  (*(size_t *)(p))
 #define PUT(p, val)  (*(size_t *)(p) = (val))
 #define PACK(size, is_alloc)  ((size)|(is_alloc))
-#define GET_SIZE(p)  (GET(p) & ~0x1) 
+#define FLAGS 0x7 // low bits of header and footer
+#define GET_SIZE(p)  (GET(p) & ~FLAGS) 
 #define GET_ALLOC(p) (GET(p) & 0x1)
+#define GET_FLAGS(p) (GET(p) & FLAGS)
+#define SET_SIZE(p, size) PUT(p, PACK(size, GET_FLAGS(p)))
+#define SET_FLAGS(p, flags) PUT(p, PACK(GET_SIZE(p), flags))
+// the header of an allocated block is read by its owner without the arena lock, while a neighbour
+// freed or malloced under the lock may set its PREV_FREE, so both go through one relaxed atomic access
+#define GET_ATOMIC(p) __atomic_load_n((size_t *)(p), __ATOMIC_RELAXED)
+#define PUT_ATOMIC(p, val) __atomic_store_n((size_t *)(p), (val), __ATOMIC_RELAXED)
 #define UNALLOC 1
 #define ALLOC 0
 #define TAIL_SIZE (sizeof(size_t))
+#define HEAD_SIZE (sizeof(size_t)) // the header in front of every payload
+#define TH_HEAD_SIZE (2 * sizeof(size_t)) // header and owner of a block without lock
+#define MIN_SIZE (2 * sizeof(void *) + TAIL_SIZE) // payload of a free block of lock version holds the links and footer
+#define MIN_SIZE_TH (4 * sizeof(void *)) // payload of a free block without lock holds the links and tree links
+#define TREE_MIN_SIZE (4 * sizeof(void *) + TAIL_SIZE) // free block of lock version in the size tree also holds left / right
+#define SMALL_NUM ((TREE_MIN_SIZE - MIN_SIZE + ALIGNMENT - 1) / ALIGNMENT) // lists of free blocks too small for the tree
+#define SMALL_INDEX(size) (((size) - MIN_SIZE) / ALIGNMENT)
+#define MMAPPED 2 // flags of block in its own mapping
+#define ALIGNED 3 // flags of the header in front of an aligned pointer, FRONT is the real block
+#define PREV_FREE 4 // flag of an allocated block of lock version: the block before it is free
+#define ALIGNMENT 16 // payload alignment, the same as glibc malloc on x86-64
+#define MMAP_THRESHOLD (128 * 1024) // default threshold of mmap block
+#define TRIM_THRESHOLD (256 * 1024) // free block at the top larger than it is given back to os
+#define TRIM_PAD (64 * 1024) // free space kept at the top after trimming
+#define ARENA_MAX 64 // max number of arenas of lock version
+#define ARENA_PER_CPU 4 // default number of arenas for every cpu
+#define ARENA_REGION ((size_t)1 << 30) // address space of every arena except arena 0
+#define HUGE_PAGE ((size_t)2 << 20) // transparent huge page of x86-64, regions with huge pages are aligned to it
+#define ARENA_TRIM_THRESHOLD (64 * 1024 * 1024) // min trim threshold of arenas except arena 0
+#define CHUNK_MIN (64 * 1024) // first chunk of a heap without lock, it doubles with every new chunk
+#define CHUNK_MAX (4 * 1024 * 1024) // chunks stop doubling here
+#define HEAP_REGION ((size_t)1 << 30) // address space every heap without lock carves its chunks from
+#define QUICK_MAX 1024 // with deferred coalescing a freed block <= QUICK_MAX without lock waits in a quick list
+#define QUICK_NUM (QUICK_MAX / ALIGNMENT + 1)
+#define NEXT_BLOCK(p) ((void*)(p) + HEAD_SIZE + GET_SIZE(p)) // where the next block of lock version starts
+#define NEXT_BLOCK_TH(p) ((void*)(p) + TH_HEAD_SIZE + GET_SIZE(p)) // header of the next block without lock
+// the word in front of the header: the owner heap of a block without lock,
+// the real block of an ALIGNED header, and padding of a mmapped block
+#define FRONT(p) (*(void **)((void *)(p) - sizeof(void *)))
 
+struct thread_heap;
+
+// header = PACK(size, flags), next and prev are valid only when the block is free, they are the payload otherwise
 struct metadata {
-  size_t size;
-  size_t is_alloc;
+  size_t header;
   struct metadata * next;
   struct metadata * prev;
+  struct metadata * left; // size tree, free block >= TREE_MIN_SIZE (every free block without lock) only
+  struct metadata * right;
 };
 typedef struct metadata Metadata;
 
+// private mapping of a heap without lock, its blocks follow this header and end at end,
+// where a header of size 0 which is never free stops coalescing into the next chunk
+struct chunk {
+  struct chunk * next;
+  void * end; // header behind the last block
+  size_t length; // of the mapping
+} __attribute__((aligned(16))); // the owner word of the first block is aligned
+typedef struct chunk Chunk;
+
+// free lists of the version without lock, outlive the thread which creates it
+struct thread_heap {
+  Metadata * first_free_block; // free block list header, ordered by address
+  Metadata * last_free_block; // free block list tail
+  Metadata * free_tree; // size tree of the same blocks
+  Metadata * _Atomic remote_free; // blocks freed by other threads, linked by next
+  struct thread_heap * next_abandoned;
+  Chunk * chunks; // the first one is current, blocks are bumped from it
+  void * region; // chunks are carved from [region, region + HEAP_REGION) upwards
+  void * region_top;
+  void * chunk_top; // owner word of the next block bumped from the current chunk
+  void * chunk_end; // chunk_top never passes it
+  void * chunk_high; // memory of the current chunk above it is fresh from os (all zero)
+  size_t chunk_size; // length of the next chunk
+  Metadata * quick[QUICK_NUM]; // freed blocks not coalesced yet, one list per size, linked by next
+  size_t quick_size; // bytes in quick lists (with headers and owner words)
+  int huge; // the region is advised to use huge pages
+  struct thread_heap * next_heap; // every heap ever created, for the statistics
+};
+typedef struct thread_heap ThreadHeap;
+
+// heap of the lock version with its own free lists, lock and region, blocks of different arenas
+// are never neighbours. Arena 0 grows with sbrk, every other one in its part of arena_region
+struct arena {
+  pthread_mutex_t lock;
+  Metadata * first_free; // free block list header
+  Metadata * last_free; // free block list tail
+  Metadata * free_tree; // size tree of the blocks in free list
+  Metadata * small_free[SMALL_NUM]; // free blocks < TREE_MIN_SIZE, one list per size
+  void * top; // end of the last block
+  size_t top_prev_free; // PREV_FREE if the block ending at top is free
+  void * base; // region [base, base + ARENA_REGION), NULL for arena 0
+  void * high; // memory of the region above high is fresh from os (all zero)
+} __attribute__((aligned(64)));
+typedef struct arena Arena;
+
 // static function signature
 // static void * reuse_block(size_t size, Metadata * p);
-static void * allocate_block(size_t size);
+static void * allocate_block(size_t size, Arena *a);
 static void *allocate_block_with_lock(size_t size);
-static void* my_sbrk(size_t size);
+static void* my_sbrk(Arena *a, size_t size);
 static void* my_sbrk_with_lock(size_t size);
 // static void remove_block(Metadata * p);
 static void set_tail(Metadata *p);
+static void set_prev_free(Arena *a, void *next, size_t prev_free);
 // static void add_block_to_head(Metadata *p);
 // static void coalesc_tail(Metadata *p);
 
-static void coalesc_tail(Metadata *p, Metadata ** first_free_block, Metadata ** last_free_block);
-static void * reuse_block(size_t size, Metadata * p, Metadata ** first_free_block, Metadata **last_free_block);
-static void add_block_to_head(Metadata *p,  Metadata ** first_free_block, Metadata ** last_free_block);
-static void remove_block(Metadata * p,  Metadata ** first_free_block, Metadata ** last_free_block);
-static void coalesc_tail(Metadata *p, Metadata ** first_free_block, Metadata ** last_free_block);
+static Metadata * coalesc_tail(Metadata *p, Arena *a);
+static void * reuse_block(size_t size, Metadata * p, Arena *a);
+static void add_block_to_head(Metadata *p,  Arena *a);
+static void remove_block(Metadata * p,  Arena *a);
+static size_t trim_top_lock(Arena *a, Metadata *p, size_t pad);
+static size_t trim_top_th(ThreadHeap *heap, size_t pad);
+
+// counters of statistics, see below
+enum {STAT_HEAP, STAT_MMAP, STAT_MMAP_BLOCKS, STAT_IN_USE, STAT_FREE, STAT_FREE_BLOCKS, STAT_MALLOC,
+      STAT_FREE_CALLS, STAT_REALLOC, STAT_SBRK, STAT_MMAP_CALLS, STAT_MUNMAP, STAT_LOCK, STAT_CONTENDED, STAT_NUM};
+static void stat_add(int stat, long n);
+static unsigned long stat_sum(int stat);
+static void lock_count(pthread_mutex_t *m);
+static void * reserve_region(size_t length, int *huge);
 
-Metadata * first_free_lock = NULL;
-Metadata * last_free_lock = NULL;
+Arena arenas[ARENA_MAX] = {[0] = {.lock = PTHREAD_MUTEX_INITIALIZER}};
+int arena_num = 1;
+static void * arena_region = NULL; // (arena_num - 1) * ARENA_REGION bytes, reserved once
+static int arena_first = 0; // first arena given to threads, 1 if the regions use huge pages (arena 0 is the fallback)
+static int huge_pages = 0; // regions reserved from now on use transparent huge pages
+static unsigned int arena_conf = 0; // number of arenas asked by ts_set_arena_num
+static atomic_uint arena_next = 0; // threads are given arenas round robin
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+static __thread Arena * arena_th = NULL; // arena current thread mallocs from first
 
-__thread Metadata * first_free_block_th = NULL; // free block list header
-__thread Metadata * last_free_block_th = NULL; // free block list tail
+static __thread ThreadHeap * heap_th = NULL; // heap owned by current thread
+static ThreadHeap * abandoned_heap = NULL; // heaps of exited threads, protected by mutex
+static ThreadHeap * _Atomic heap_list = NULL; // every heap, readers walk it without lock
 
 
-size_t data_size = 0;  // record allocated data
-size_t free_size = 0; // record available data
 void *begin = NULL; //use to check invalid address
 void *begin_th = NULL;
+void *brk_high = NULL; // the highest break we have seen, memory above it is fresh from os
+static __thread int sbrk_fresh = 0; // if memory from the last sbrk of this thread is fresh from os
+static __thread void *fresh_block_th = NULL; // payload of the last block made of fresh memory
 
 size_t op = 0; // debug
+atomic_size_t mmap_threshold = MMAP_THRESHOLD; // malloc size >= threshold use mmap
+atomic_size_t trim_threshold = TRIM_THRESHOLD;
+atomic_size_t defer_limit = 0; // deferred coalescing without lock: max bytes in the quick lists of a heap, 0 is off
+atomic_int stack_readers = 0; // pops of the class stacks which may read the link of a block they do not own
 
 // pthread lock
-pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; // mutex for thread
 pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER; // mutex for sbrk
 
 
-// function to do alignment, unnessary in this experiment
+// function to do alignment for the lock version, size + header is a multiple of ALIGNMENT,
+// so every header sits one word before an aligned payload, and a free block has room for the links and footer
 static size_t align(size_t size){
-  return (size+DSIZE-1) / DSIZE * DSIZE;
+  if(size < MIN_SIZE) size = MIN_SIZE;
+  return (size + HEAD_SIZE + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT - HEAD_SIZE;
+}
+
+// function to do alignment for the version without lock (no footer, the owner word is in front of the header)
+static size_t align_th(size_t size){
+  if(size < MIN_SIZE_TH) size = MIN_SIZE_TH;
+  return (size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
 }
 
-// set the footer for block
+// the block of ptr, skip the header in front of an aligned pointer
+static Metadata * get_block(void *ptr){
+  Metadata *p = (Metadata *)((char *)ptr - HEAD_SIZE);
+  if((GET_ATOMIC(p) & FLAGS) == ALIGNED) p = FRONT(p);
+  return p;
+}
+
+// set the footer for free block of lock version, in the last word of its payload
 static void set_tail(Metadata *p){
-  size_t size = p->size;
-  size_t is_alloc = p->is_alloc;
-  void *tail_ptr = (void*)p + size + sizeof(Metadata);
-  PUT(tail_ptr, PACK(size, is_alloc));
+  void *tail_ptr = NEXT_BLOCK(p) - TAIL_SIZE;
+  PUT(tail_ptr, PACK(GET_SIZE(p), UNALLOC));
+}
+
+// tell the block starting at next (or the one which will start at top of a) if the block before it is free (hold a->lock)
+static void set_prev_free(Arena *a, void *next, size_t prev_free){
+  if(next == a->top){
+    a->top_prev_free = prev_free;
+    return;
+  }
+  PUT_ATOMIC(next, (GET(next) & ~PREV_FREE) | prev_free);
 }
 
 // reuse previous block
-static void * reuse_block(size_t size, Metadata * p, Metadata ** first_free_block, Metadata **last_free_block) {
-  if (p->size - size >= sizeof(Metadata)+DSIZE+TAIL_SIZE) {
-    Metadata * remain = (Metadata *)((char *)p + sizeof(Metadata) + size+TAIL_SIZE);
-    remain->size = p->size - size - sizeof(Metadata)-TAIL_SIZE;
-    remain->is_alloc = UNALLOC;
+static void * reuse_block(size_t size, Metadata * p, Arena *a) {
+  remove_block(p, a); // before the size of p changes
+  if (GET_SIZE(p) - size >= HEAD_SIZE+MIN_SIZE) {
+    Metadata * remain = (Metadata *)((char *)p + HEAD_SIZE + size);
+    PUT(remain, PACK(GET_SIZE(p) - size - HEAD_SIZE, UNALLOC));
     // remain->next = p->next;
-//     if(p == *last_free_block){
-//       *last_free_block = remain;
+//     if(p == a->last_free){
+//       a->last_free = remain;
 //     }else{
 //       if(p->next) p->next->prev = remain;
 //     }
     // p->next = remain;
     // remain->prev = p;
-    add_block_to_head(remain, first_free_block, last_free_block);
-    p->size = size; 
+    PUT(p, PACK(size, ALLOC)); // the block before a free block is never free
     set_tail(remain);
+    add_block_to_head(remain, a);
+  }else{
+    set_prev_free(a, NEXT_BLOCK(p), 0);
+    SET_FLAGS(p, ALLOC);
   }
-  free_size -= p->size + sizeof(Metadata)+TAIL_SIZE;
-  remove_block(p, first_free_block, last_free_block);
-  p->is_alloc = ALLOC;
-  set_tail(p);
-  return (char *)p + sizeof(Metadata);
+  stat_add(STAT_FREE, -(long)(GET_SIZE(p) + HEAD_SIZE));
+  return (char *)p + HEAD_SIZE;
+}
+
+// sbrk with the break moved to offset bytes past a multiple of ALIGNMENT first (hold mutex)
+static void* sbrk_aligned(size_t size, size_t offset){
+  size_t pad = (offset - (uintptr_t)sbrk(0)) & (ALIGNMENT - 1);
+  if(pad){
+    stat_add(STAT_SBRK, 1);
+    if(sbrk(pad) == (void*)-1) return (void*)-1;
+  }
+  stat_add(STAT_SBRK, 1);
+  return sbrk(size);
 }
 
-// wrapper sbrk function to record allocated data
-static void* my_sbrk(size_t size){
-  if(begin == NULL){
-    begin = sbrk(0);
+// wrapper sbrk function to record allocated data, the break is shared with version without lock,
+// arenas other than arena 0 move the top of their own region instead (hold a->lock)
+// blocks of lock version start one word before an aligned address, so their payload is aligned
+static void* my_sbrk(Arena *a, size_t size){
+  if(a != arenas){
+    void *res = a->top;
+    if(size > (size_t)(a->base + ARENA_REGION - res)) return NULL;
+    a->top = res + size;
+    stat_add(STAT_HEAP, size);
+    sbrk_fresh = res >= a->high;
+    if(a->top > a->high) a->high = a->top;
+    return res;
+  }
+  lock_count(&mutex);
+  void *res = sbrk_aligned(size, HEAD_SIZE);
+  if(begin == NULL && res != (void*)-1){
+    begin = res;
+  }
+  if(res != (void*)-1){
+    stat_add(STAT_HEAP, size);
+    a->top = res + size;
+    sbrk_fresh = res >= brk_high;
+    if(a->top > brk_high) brk_high = a->top;
   }
-  void *res = sbrk(size);
+  pthread_mutex_unlock(&mutex);
   if(res != (void*)-1){
-    // data_size += size
     return res;
   }
   return NULL;
 }
 
-// expend heap size to create new block
-static void * allocate_block(size_t size) {
-  Metadata * new_block = my_sbrk(size + sizeof(Metadata)+TAIL_SIZE);
+// extend the top of a by size only if it is still at end, the block ending at end grows in place (hold a->lock)
+static int my_sbrk_at(Arena *a, void *end, size_t size){
+  if(a != arenas){
+    if(end != a->top || size > (size_t)(a->base + ARENA_REGION - end)) return 0;
+    a->top = end + size;
+    stat_add(STAT_HEAP, size);
+    if(a->top > a->high) a->high = a->top;
+    return 1;
+  }
+  lock_count(&mutex);
+  int res = 0;
+  if(end == sbrk(0)){
+    stat_add(STAT_SBRK, 1);
+    res = sbrk(size) != (void*)-1;
+  }
+  if(res){
+    stat_add(STAT_HEAP, size);
+    if(a->top == end) a->top = end + size;
+    if(end + size > brk_high) brk_high = end + size;
+  }
+  pthread_mutex_unlock(&mutex);
+  return res;
+}
+
+// expend heap size of arena to create new block (hold a->lock)
+static void * allocate_block(size_t size, Arena *a) {
+  void *old_top = a->top;
+  Metadata * new_block = my_sbrk(a, size + HEAD_SIZE);
   if(new_block == NULL){
     return NULL;
   }
-  new_block->size = size;
-  new_block->is_alloc = ALLOC;
-  new_block->prev = NULL;
-  new_block->next = NULL;
-  set_tail(new_block);
-  return (void *)new_block + sizeof(Metadata);
+  // the break may be moved by others, then the block before is not ours
+  PUT(new_block, PACK(size, ALLOC | ((void*)new_block == old_top ? a->top_prev_free : 0)));
+  a->top_prev_free = 0;
+  if(sbrk_fresh) fresh_block_th = (void *)new_block + HEAD_SIZE;
+  return (void *)new_block + HEAD_SIZE;
 }
 
 static void* my_sbrk_with_lock(size_t size){
-  pthread_mutex_lock(&mutex);
-  if(begin_th == NULL){
-    begin_th = sbrk(0);
+  lock_count(&mutex);
+  void *res = sbrk_aligned(size, 0);
+  if(begin_th == NULL && res != (void*)-1){
+    begin_th = res;
+  }
+  if(res != (void*)-1){
+    stat_add(STAT_HEAP, size);
+    sbrk_fresh = res >= brk_high;
+    if(res + size > brk_high) brk_high = res + size;
   }
-  void *res = sbrk(size);
-  // end_th = res;
   pthread_mutex_unlock(&mutex);
   if(res != (void*)-1){
-    data_size += size;
     return res;
   }
   return NULL;
 }
 
 static void *allocate_block_with_lock(size_t size){
-  Metadata * new_block = my_sbrk_with_lock(size + sizeof(Metadata)+TAIL_SIZE);
-  if(new_block == NULL){
+  void *res = my_sbrk_with_lock(size + TH_HEAD_SIZE);
+  if(res == NULL){
+    return NULL;
+  }
+  Metadata * new_block = res + sizeof(void *); // behind the owner word
+  PUT(new_block, PACK(size, ALLOC));
+  return (void *)new_block + HEAD_SIZE;
+
+}
+
+// length of the mapping holding block with size
+static size_t mmap_length(size_t size){
+  size_t page = sysconf(_SC_PAGESIZE);
+  return (size + TH_HEAD_SIZE + page - 1) / page * page;
+}
+
+// put large block in its own mapping, no lock needed
+// the header is one word into the mapping, so the payload is aligned
+static void * mmap_block(size_t size) {
+  size = align_th(size); // keep the low bits for the flags
+  size_t length = mmap_length(size);
+  void *res = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(res == MAP_FAILED){
+    return NULL;
+  }
+  Metadata * new_block = res + sizeof(void *);
+  PUT(new_block, PACK(size, MMAPPED));
+  stat_add(STAT_MMAP_CALLS, 1);
+  stat_add(STAT_MMAP_BLOCKS, 1);
+  stat_add(STAT_MMAP, length);
+  fresh_block_th = (void *)new_block + HEAD_SIZE;
+  return (void *)new_block + HEAD_SIZE;
+}
+
+static void munmap_block(Metadata *p){
+  size_t length = mmap_length(GET_SIZE(p));
+  stat_add(STAT_MUNMAP, 1);
+  stat_add(STAT_MMAP_BLOCKS, -1);
+  stat_add(STAT_MMAP, -(long)length);
+  munmap((void *)p - sizeof(void *), length);
+}
+
+// resize the mapping, the kernel moves the pages rather than copy them
+static void * mremap_block(Metadata *p, size_t size){
+  size = align_th(size);
+  size_t old_length = mmap_length(GET_SIZE(p));
+  size_t length = mmap_length(size);
+  if(length != old_length){
+    void *res = mremap((void *)p - sizeof(void *), old_length, length, MREMAP_MAYMOVE);
+    if(res == MAP_FAILED){
+      return NULL;
+    }
+    p = res + sizeof(void *);
+    stat_add(STAT_MMAP_CALLS, 1);
+    stat_add(STAT_MMAP, (long)length - (long)old_length);
+  }
+  SET_SIZE(p, size);
+  return (void *)p + HEAD_SIZE;
+}
+
+static int is_mmap_size(size_t size){
+  return size >= atomic_load_explicit(&mmap_threshold, memory_order_relaxed);
+}
+
+// calloc with the given malloc version, memory fresh from os is already zero
+static void * calloc_block(size_t num, size_t size, void *(*malloc_fn)(size_t)){
+  if(size && num > SIZE_MAX / size) return NULL;
+  fresh_block_th = NULL;
+  void *res = malloc_fn(num * size);
+  if(res && res != fresh_block_th) memset(res, 0, num * size);
+  return res;
+}
+
+// memalign with the given malloc version, the header in front of the aligned pointer
+// is tagged ALIGNED and its FRONT word points to the real block, so free and realloc can find it.
+// A ptr which is aligned already is tagged too, one alignment up, else the block would hold
+// alignment bytes more than the size it is malloced with
+static void * memalign_block(size_t alignment, size_t size, void *(*malloc_fn)(size_t)){
+  if(alignment <= ALIGNMENT) return malloc_fn(size);
+  if(size > SIZE_MAX - alignment) return NULL;
+  // ptr is aligned to ALIGNMENT, so there are at least two words in front of the aligned pointer
+  char *ptr = malloc_fn(size + alignment);
+  if(ptr == NULL) return NULL;
+  uintptr_t aligned = ((uintptr_t)ptr + alignment) & ~(uintptr_t)(alignment - 1);
+  Metadata *real = (Metadata *)(ptr - HEAD_SIZE);
+  Metadata *p = (Metadata *)(aligned - HEAD_SIZE);
+  PUT(p, PACK((uintptr_t)ptr + GET_SIZE(real) - aligned, ALIGNED));
+  FRONT(p) = real;
+  return (void *)aligned;
+}
+
+// realloc with the given malloc / free version, after the block cannot be resized in place
+static void * realloc_block(void *ptr, size_t size, void *(*malloc_fn)(size_t), void (*free_fn)(void *)){
+  if(ptr == NULL) return malloc_fn(size);
+  if(size == 0){
+    free_fn(ptr);
     return NULL;
   }
-  new_block->size = size;
-  new_block->is_alloc = ALLOC;
-  new_block->prev = NULL;
-  new_block->next = NULL;
-  set_tail(new_block);
-  return (void *)new_block + sizeof(Metadata);
+  Metadata * p = (Metadata *)((char *)ptr - HEAD_SIZE);
+  size_t head = GET_ATOMIC(p);
+  if((head & FLAGS) == MMAPPED && is_mmap_size(size)){
+    return mremap_block(p, size);
+  }
+  void *res = malloc_fn(size);
+  if(res == NULL) return NULL;
+  size_t old = head & ~FLAGS;
+  memcpy(res, ptr, old < size ? old : size);
+  free_fn(ptr);
+  return res;
+}
+
+/*
+*
+*  Size tree: a treap keyed by (size, address), the priority is a hash of the address,
+*  so it stays balanced without any field for it. Lookup, insert and remove are O(log n).
+*
+*/
+
+// priority of node p, parents have higher priority than children
+static uintptr_t tree_priority(Metadata *p){
+  return (uintptr_t)p * 0x9E3779B97F4A7C15ull;
+}
+
+// if a is before b in (size, address) order
+static int tree_less(Metadata *a, Metadata *b){
+  return GET_SIZE(a) < GET_SIZE(b) || (GET_SIZE(a) == GET_SIZE(b) && a < b);
+}
+
+// insert p into the tree at root, return the new root
+static Metadata * tree_insert(Metadata *root, Metadata *p){
+  if(root == NULL){
+    p->left = NULL;
+    p->right = NULL;
+    return p;
+  }
+  if(tree_less(p, root)){
+    root->left = tree_insert(root->left, p);
+    if(tree_priority(root->left) > tree_priority(root)){
+      Metadata *l = root->left; // rotate right
+      root->left = l->right;
+      l->right = root;
+      return l;
+    }
+  }else{
+    root->right = tree_insert(root->right, p);
+    if(tree_priority(root->right) > tree_priority(root)){
+      Metadata *r = root->right; // rotate left
+      root->right = r->left;
+      r->left = root;
+      return r;
+    }
+  }
+  return root;
+}
+
+// join two trees, all nodes of a are before the nodes of b
+static Metadata * tree_join(Metadata *a, Metadata *b){
+  if(a == NULL) return b;
+  if(b == NULL) return a;
+  if(tree_priority(a) > tree_priority(b)){
+    a->right = tree_join(a->right, b);
+    return a;
+  }
+  b->left = tree_join(a, b->left);
+  return b;
+}
+
+// remove p from the tree at root, return the new root
+static Metadata * tree_remove(Metadata *root, Metadata *p){
+  if(root == NULL) return NULL;
+  if(root == p) return tree_join(p->left, p->right);
+  if(tree_less(p, root)){
+    root->left = tree_remove(root->left, p);
+  }else{
+    root->right = tree_remove(root->right, p);
+  }
+  return root;
+}
+
+// the smallest block not smaller than size, the lowest address among equal sizes
+static Metadata * tree_best_fit(Metadata *root, size_t size){
+  Metadata *best = NULL;
+  while(root){
+    if(GET_SIZE(root) >= size){
+      best = root;
+      root = root->left;
+    }else{
+      root = root->right;
+    }
+  }
+  return best;
+}
 
+// the first block in the lists of small blocks of arena which can hold size (hold a->lock)
+static Metadata * small_fit(size_t size, Arena *a){
+  if(size >= TREE_MIN_SIZE) return NULL;
+  for(size_t i = SMALL_INDEX(size); i < SMALL_NUM; i++){
+    if(a->small_free[i]) return a->small_free[i];
+  }
+  return NULL;
 }
 
-// add availble block as head of free block list
-static void add_block_to_head(Metadata *p,  Metadata **first_free_block, Metadata ** last_free_block){
-  if(!*first_free_block){
-    *first_free_block = p;
-    *last_free_block = p;
+// add availble block as head of free block list (and into the size tree),
+// or as head of the list of its size if it is too small for the tree (hold a->lock)
+static void add_block_to_head(Metadata *p,  Arena *a){
+  stat_add(STAT_FREE_BLOCKS, 1);
+  if(GET_SIZE(p) < TREE_MIN_SIZE){
+    Metadata **head = &a->small_free[SMALL_INDEX(GET_SIZE(p))];
+    p->next = *head;
+    p->prev = NULL;
+    if(*head) (*head)->prev = p;
+    *head = p;
+    return;
+  }
+  a->free_tree = tree_insert(a->free_tree, p);
+  if(!a->first_free){
+    a->first_free = p;
+    a->last_free = p;
     p->next = NULL;
     p->prev = NULL;
     return;
   }
-  p->next = *first_free_block;
-  (*first_free_block) -> prev = p;
+  p->next = a->first_free;
+  a->first_free->prev = p;
   p->prev = NULL;
-  *first_free_block = p;
+  a->first_free = p;
 }
 
-// remove the block
-static void remove_block(Metadata * p,  Metadata ** first_free_block, Metadata ** last_free_block) {
-  if(*first_free_block == p){
-    *first_free_block = p->next; // if p is last node, p->next = NULL
-    if(p == *last_free_block) *last_free_block = NULL;
+// remove the block, its size must be the one it is added with (hold a->lock)
+static void remove_block(Metadata * p,  Arena *a) {
+  stat_add(STAT_FREE_BLOCKS, -1);
+  if(GET_SIZE(p) < TREE_MIN_SIZE){
+    if(p->next) p->next->prev = p->prev;
+    if(p->prev) p->prev->next = p->next;
+    else a->small_free[SMALL_INDEX(GET_SIZE(p))] = p->next;
+    return;
+  }
+  a->free_tree = tree_remove(a->free_tree, p);
+  if(a->first_free == p){
+    a->first_free = p->next; // if p is last node, p->next = NULL
+    if(p == a->last_free) a->last_free = NULL;
     if(p->next != NULL) p->next->prev = NULL;
   }
   else{
     if(p->next!= NULL)p->next->prev = p->prev;
     p->prev->next = p->next;
-    if(p == *last_free_block) *last_free_block = p->prev; 
+    if(p == a->last_free) a->last_free = p->prev; 
   }
   p->next = NULL;
   p->prev = NULL;
 }
 
-// use footer to coalesc block with previous one and next one
-static void coalesc_tail(Metadata *p, Metadata ** first_free_block, Metadata ** last_free_block){
-  if(!p) return;
-  if((void*)p + sizeof(Metadata) + p->size+TAIL_SIZE < sbrk(0)){
-    Metadata *pnext = (Metadata*)((void*)p + sizeof(Metadata) + p->size+TAIL_SIZE);
-    if(pnext->is_alloc == UNALLOC){
-      p->size += sizeof(Metadata) + pnext->size + TAIL_SIZE;
-      remove_block(pnext,first_free_block, last_free_block);
-      set_tail(p);
+// coalesc free block with previous one and next one, add the coalesced block to free list and return it
+// p is not in free list yet, the footer of previous block is read only if p is tagged PREV_FREE (hold a->lock)
+static Metadata * coalesc_tail(Metadata *p, Arena *a){
+  if(!p) return NULL;
+  if(NEXT_BLOCK(p) != a->top){
+    Metadata *pnext = (Metadata*)NEXT_BLOCK(p);
+    if(GET_FLAGS(pnext) == UNALLOC){
+      SET_SIZE(p, GET_SIZE(p) + HEAD_SIZE + GET_SIZE(pnext));
+      remove_block(pnext,a);
     }
   }
-  // if(((void *)p != (void*)last_free_block)&& p->next&& (void*)p->next == (void*)p+sizeof(Metadata)+p->size+TAIL_SIZE){
+  // if(((void *)p != (void*)last_free_block)&& p->next&& (void*)p->next == (void*)p+HEAD_SIZE+GET_SIZE(p)+TAIL_SIZE){
   //   if(p->next->is)
-  //   p->size += sizeof(Metadata) + p->next->size + TAIL_SIZE;
-  //   remove_block(p->next, first_free_block, last_free_block);
+  //   SET_SIZE(p, GET_SIZE(p) + HEAD_SIZE + GET_SIZE(p->next) + TAIL_SIZE);
+  //   remove_block(p->next, a);
   //   set_tail(p);
   // }
-  void *prev_tail = (void *)p - TAIL_SIZE;
-  if(prev_tail > begin && prev_tail - GET_SIZE(prev_tail) - sizeof(Metadata) > begin){
-    if (GET_ALLOC(prev_tail) == UNALLOC){
-      Metadata *pprev = (Metadata*)(prev_tail - GET_SIZE(prev_tail) - sizeof(Metadata));
-      pprev->size += sizeof(Metadata) + TAIL_SIZE + p->size;
-      set_tail(pprev);
-      remove_block(p, first_free_block, last_free_block);
-    }
+  if(GET_FLAGS(p) & PREV_FREE){
+    void *prev_tail = (void *)p - TAIL_SIZE;
+    Metadata *pprev = (Metadata*)((void *)p - GET_SIZE(prev_tail) - HEAD_SIZE);
+    remove_block(pprev, a); // before its size changes
+    SET_SIZE(pprev, GET_SIZE(pprev) + HEAD_SIZE + GET_SIZE(p));
+    p = pprev;
   }
+  SET_FLAGS(p, UNALLOC);
+  set_tail(p);
+  set_prev_free(a, NEXT_BLOCK(p), PREV_FREE);
+  add_block_to_head(p, a);
+  return p;
 }
 
-static void coalesc_tail_with_lock(Metadata *p, Metadata ** first_free_block, Metadata ** last_free_block){
-  if(!p) return;
-  if((void*)p + sizeof(Metadata) + p->size+TAIL_SIZE < sbrk(0)){
-    Metadata *pnext = (Metadata*)((void*)p + sizeof(Metadata) + p->size+TAIL_SIZE);
-    if(pnext->is_alloc == UNALLOC){
-      remove_block(pnext, first_free_block, last_free_block);
-      p->size += sizeof(Metadata) + pnext->size + TAIL_SIZE;
-      set_tail(p);
+// give the free block at the top of arena back to os, keep pad bytes of it (hold a->lock)
+// the pages of a region are given back with madvise, they read as zero again
+static size_t trim_top_lock(Arena *a, Metadata *p, size_t pad){
+  void *end = NEXT_BLOCK(p);
+  size_t release = HEAD_SIZE + GET_SIZE(p);
+  pad = pad > 0 ? align(pad) : 0;
+  if(pad > 0 && GET_SIZE(p) <= pad) return 0;
+  if(pad > 0) release = GET_SIZE(p) - pad; // keep the block with a smaller size
+  if(GET_FLAGS(p) != UNALLOC || end != a->top) return 0;
+  // a pop of a class stack may still read a block which is now free, it must not be unmapped under it
+  if(a == arenas && atomic_load(&stack_readers)) return 0;
+  if(a == arenas){
+    lock_count(&mutex);
+    // the break may be moved by version without lock
+    if(end != sbrk(0)){
+      pthread_mutex_unlock(&mutex);
+      return 0;
     }
   }
-  void *prev_tail = (void *)p - TAIL_SIZE;
-  if(prev_tail > begin && prev_tail - GET_SIZE(prev_tail) - sizeof(Metadata) > begin){
-    if (GET_ALLOC(prev_tail) == UNALLOC){
-      Metadata *pprev = (Metadata*)(prev_tail - GET_SIZE(prev_tail) - sizeof(Metadata));
-      pprev->size += sizeof(Metadata) + TAIL_SIZE + p->size;
-      set_tail(pprev);
-      remove_block(p, first_free_block, last_free_block);
+  if(pad > 0){
+    remove_block(p, a);
+    SET_SIZE(p, pad);
+    set_tail(p);
+    add_block_to_head(p, a);
+  }else{
+    remove_block(p, a); // before the memory of p is gone
+    a->top_prev_free = 0; // the block before a free block is never free
+  }
+  a->top -= release;
+  stat_add(STAT_FREE, -(long)release);
+  if(a == arenas){
+    sbrk(-(intptr_t)release);
+    stat_add(STAT_SBRK, 1);
+    stat_add(STAT_HEAP, -(long)release);
+    pthread_mutex_unlock(&mutex);
+    return release;
+  }
+  stat_add(STAT_HEAP, -(long)release);
+  size_t page = arena_first ? HUGE_PAGE : (size_t)sysconf(_SC_PAGESIZE); // huge pages are given back whole
+  void *start = (void *)(((uintptr_t)a->top + page - 1) & ~(page - 1));
+  if(start < end) madvise(start, end - start, MADV_DONTNEED);
+  if(a->high > start) a->high = start;
+  return release;
+}
+
+static void coalesc_tail_with_lock(Metadata *p, Arena *a){
+  coalesc_tail(p, a);
+}
+// resize the block of arena without moving it, return 0 if the next block cannot give enough space (hold a->lock)
+static int resize_block(Arena *a, Metadata *p, size_t size){
+  if(size > GET_SIZE(p)){
+    void *next = NEXT_BLOCK(p);
+    if(next == a->top && my_sbrk_at(a, next, size - GET_SIZE(p))){
+      // the block is at the top of heap
+      SET_SIZE(p, size);
+      return 1;
     }
+    if(next == a->top) return 0;
+    Metadata *pnext = (Metadata*)next;
+    if(GET_FLAGS(pnext) != UNALLOC || GET_SIZE(p) + HEAD_SIZE + GET_SIZE(pnext) < size) return 0;
+    remove_block(pnext, a);
+    stat_add(STAT_FREE, -(long)(HEAD_SIZE + GET_SIZE(pnext)));
+    SET_SIZE(p, GET_SIZE(p) + HEAD_SIZE + GET_SIZE(pnext));
+    set_prev_free(a, NEXT_BLOCK(p), 0);
   }
+  // split the tail off as reuse_block does
+  size_t remain_size = GET_SIZE(p) - size;
+  if(remain_size < HEAD_SIZE+MIN_SIZE){
+    return 1;
+  }
+  SET_SIZE(p, size);
+  Metadata * remain = (Metadata *)NEXT_BLOCK(p);
+  PUT(remain, PACK(remain_size - HEAD_SIZE, UNALLOC));
+  stat_add(STAT_FREE, remain_size);
+  coalesc_tail(remain, a);
+  return 1;
 }
+
 /** user function **/
 
-void ff_free(void * ptr, int with_sbk_lock, Metadata ** first_free_block, Metadata ** last_free_block) {
-  Metadata * p = (Metadata *)((char *)ptr - sizeof(Metadata));
-  p->is_alloc = UNALLOC;
-  free_size += p->size + sizeof(Metadata)+TAIL_SIZE;
-  set_tail(p);
-  add_block_to_head(p, first_free_block, last_free_block);
+void ff_free(void * ptr, int with_sbk_lock, Arena *a) {
+  Metadata * p = (Metadata *)((char *)ptr - HEAD_SIZE);
+  SET_FLAGS(p, UNALLOC | (GET_FLAGS(p) & PREV_FREE));
+  stat_add(STAT_FREE, GET_SIZE(p) + HEAD_SIZE);
   // if(with_sbk_lock){
-  //   coalesc_tail_with_lock(p, first_free_block, last_free_block);
+  //   coalesc_tail_with_lock(p, a);
   // }else{
-  coalesc_tail(p, first_free_block, last_free_block);
+  p = coalesc_tail(p, a);
   // }
+  size_t threshold = atomic_load_explicit(&trim_threshold, memory_order_relaxed);
+  // the thread of a region frees and mallocs again soon, madvise every time makes it fault pages in again
+  if(a != arenas && threshold < ARENA_TRIM_THRESHOLD) threshold = ARENA_TRIM_THRESHOLD;
+  if(GET_SIZE(p) >= threshold){
+    trim_top_lock(a, p, TRIM_PAD);
+  }
 }
 
-void * bf_malloc(size_t size, int with_sbk_lock, Metadata **first_free_block, Metadata **last_free_block) {
-  Metadata * p = *first_free_block;
-  Metadata * best = NULL;
-  while (p != NULL) {
-    if (p->size >= size) {
-      if ((!best) || (p->size < best->size)) {
-        best = p;
-        // the threshold of inner fragment < DSIZE 
-        if(best->size-size < DSIZE){ 
-            break; // use immediately
-        }
-      }
-    }
-    p = p->next;
-  }
+void * bf_malloc(size_t size, int with_sbk_lock, Arena *a) {
+  size = align(size);
+  Metadata * best = small_fit(size, a);
+  if (best == NULL) best = tree_best_fit(a->free_tree, size);
   if (best) {
-    return reuse_block(size, best, first_free_block, last_free_block);
+    return reuse_block(size, best, a);
   }
   else {
     // if(with_sbk_lock){
     //   return allocate_block_with_lock(size);
     // }
-    return allocate_block(size);
+    return allocate_block(size, a);
+  }
+}
+
+void bf_free(void * ptr, int with_sbk_lock, Arena *a) {
+  return ff_free(ptr, with_sbk_lock, a);
+}
+
+// cut num blocks of size from the front of block p, which is in no list, into ptrs. What is left
+// behind them goes back to the free lists, or to the last block if it is too small, return the bytes
+// given out with their headers (hold a->lock)
+static size_t carve_block(Metadata *p, size_t size, size_t num, void **ptrs, Arena *a){
+  size_t left = GET_SIZE(p) + HEAD_SIZE;
+  size_t prev_free = GET_FLAGS(p) & PREV_FREE; // only the first block follows the block before p
+  for(size_t i = 0; i < num; i++){
+    if(i > 0) p = NEXT_BLOCK(p);
+    PUT(p, PACK(size, ALLOC | prev_free));
+    prev_free = 0;
+    ptrs[i] = (char *)p + HEAD_SIZE;
+    left -= size + HEAD_SIZE;
+  }
+  if(left >= HEAD_SIZE + MIN_SIZE){
+    Metadata *remain = NEXT_BLOCK(p);
+    PUT(remain, PACK(left - HEAD_SIZE, UNALLOC));
+    set_tail(remain);
+    add_block_to_head(remain, a);
+    return num * (size + HEAD_SIZE);
+  }
+  SET_SIZE(p, size + left);
+  set_prev_free(a, NEXT_BLOCK(p), 0);
+  return num * (size + HEAD_SIZE) + left;
+}
+
+// malloc num blocks of size with the lock of a taken once: all of them are carved from the best
+// fit free block which holds them together, or from one extension of the top, and one by one
+// if neither can, return how many are malloced (hold a->lock)
+static size_t bf_malloc_batch(size_t size, size_t num, void **ptrs, Arena *a){
+  size = align(size);
+  if(num == 0) return 0;
+  if(num <= (SIZE_MAX - size) / (size + HEAD_SIZE)){
+    size_t total = num * (size + HEAD_SIZE) - HEAD_SIZE;
+    Metadata *p = small_fit(total, a);
+    if(p == NULL) p = tree_best_fit(a->free_tree, total);
+    if(p){
+      remove_block(p, a);
+      stat_add(STAT_FREE, -(long)carve_block(p, size, num, ptrs, a));
+      return num;
+    }
+    void *ptr = allocate_block(total, a);
+    if(ptr){
+      carve_block((Metadata *)((char *)ptr - HEAD_SIZE), size, num, ptrs, a);
+      return num;
+    }
+  }
+  for(size_t i = 0; i < num; i++){
+    ptrs[i] = bf_malloc(size, No_sbk_lock, a);
+    if(ptrs[i] == NULL) return i;
   }
+  return num;
 }
 
-void bf_free(void * ptr, int with_sbk_lock, Metadata **first_free_block, Metadata **last_free_block) {
-  return ff_free(ptr, with_sbk_lock, first_free_block, last_free_block);
+// free the blocks of ptrs sorted by address, every run of neighbours is joined into one block first,
+// so it is coalesced and added to the free list once (hold a->lock)
+static void bf_free_batch(void **ptrs, size_t num, Arena *a){
+  for(size_t i = 0; i < num; ){
+    Metadata *p = (Metadata *)((char *)ptrs[i] - HEAD_SIZE);
+    void *end = NEXT_BLOCK(p);
+    for(i++; i < num && (char *)ptrs[i] - HEAD_SIZE == end; i++){
+      end = NEXT_BLOCK((char *)ptrs[i] - HEAD_SIZE);
+    }
+    SET_SIZE(p, (char *)end - (char *)p - HEAD_SIZE);
+    bf_free((char *)p + HEAD_SIZE, No_sbk_lock, a);
+  }
 }
 
 unsigned long get_data_segment_size() {
-  return data_size;
+  return stat_sum(STAT_HEAP);
 }
 
 unsigned long get_data_segment_free_space_size() {
-  return free_size;
+  return stat_sum(STAT_FREE);
 }
 
-void * ts_malloc_lock(size_t size) {
-  pthread_mutex_lock(&lock);
-  void * p = bf_malloc(size, No_sbk_lock, &first_free_lock, &last_free_lock);
-  pthread_mutex_unlock(&lock);
-  return p;
+void set_trim_threshold(size_t threshold) {
+  atomic_store_explicit(&trim_threshold, threshold, memory_order_relaxed);
 }
-void ts_free_lock(void * ptr) {
-  pthread_mutex_lock(&lock);
-  bf_free(ptr, No_sbk_lock, &first_free_lock, &last_free_lock);
-  pthread_mutex_unlock(&lock);
+
+void set_mmap_threshold(size_t threshold) {
+  atomic_store_explicit(&mmap_threshold, threshold, memory_order_relaxed);
 }
 
-/* 
+unsigned long get_mmap_threshold() {
+  return atomic_load_explicit(&mmap_threshold, memory_order_relaxed);
+}
+
+unsigned long get_mmap_block_num() {
+  return stat_sum(STAT_MMAP_BLOCKS);
+}
+
+unsigned long get_mmap_size() {
+  return stat_sum(STAT_MMAP);
+}
+
+/*
 *
-*  Another version of bf_malloc(Maintain an order linklist in , whose insert time complexity O(n))
+*  Trace: every thread records its events in its own buffer, a full buffer is written to the
+*  trace file as a whole under trace_lock. Only one relaxed load is paid when tracing is off.
+*  The format is in my_malloc_trace.h.
 *
 */
 
-static void * reuse_block_th(size_t size, Metadata * p, Metadata **first_free_block, Metadata ** last_free_block);
-static void * allocate_block_th(size_t size);
-// static void* my_sbrk(size_t size);
-static void add_block_th(Metadata * p, Metadata **first_free_block, Metadata ** last_free_block);
-static void remove_block_th(Metadata * p, Metadata **first_free_block, Metadata ** last_free_block);
-static Metadata* coalesc_th(Metadata *p, Metadata **first_free_block, Metadata ** last_free_block);
-
-static void remove_block_th(Metadata * p, Metadata **first_free_block, Metadata ** last_free_block) {
-  if(*first_free_block == p){
-    *first_free_block = p->next; // if p is last node, p->next = NULL
-    if(p == *last_free_block) *last_free_block = NULL;
-    if(p->next != NULL) p->next->prev = NULL;
-  }
-  else{
-    if(p->next!= NULL)p->next->prev = p->prev;
-    p->prev->next = p->next;
-    if(p == *last_free_block) *last_free_block = p->prev; 
+#define TRACE_BUF_NUM 4096 // events in the buffer of a thread
+
+struct trace_buffer {
+  TraceEvent event[TRACE_BUF_NUM];
+  size_t num;
+  uint32_t thread;
+  atomic_int writing; // set while the owner thread adds an event
+  int in_use; // owned by a living thread, protected by trace_lock
+  struct trace_buffer * next; // buffers are never freed, protected by trace_lock
+};
+typedef struct trace_buffer TraceBuffer;
+
+static atomic_int trace_on = 0;
+static int trace_fd = -1;
+static uint64_t trace_start_ns = 0;
+static uint32_t trace_threads = 0;
+static TraceBuffer * trace_buffers = NULL;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t trace_key;
+static __thread TraceBuffer * trace_buf = NULL;
+
+static void trace_event(uint32_t op, void *ptr, size_t size);
+
+#define TRACE(op, ptr, size) \
+  do{ if(atomic_load_explicit(&trace_on, memory_order_relaxed)) trace_event(op, ptr, size); }while(0)
+
+static uint64_t trace_now(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// write the events of buf to the trace file (hold trace_lock)
+static void trace_write(TraceBuffer *buf){
+  char *data = (char *)buf->event;
+  size_t left = buf->num * sizeof(TraceEvent);
+  while(left > 0 && trace_fd >= 0){
+    ssize_t n = write(trace_fd, data, left);
+    if(n <= 0) break;
+    data += n;
+    left -= n;
   }
-  p->next = NULL;
-  p->prev = NULL;
+  buf->num = 0;
 }
 
+// write the rest of events and give the buffer to the next thread when the thread exits
+static void trace_destructor(void *arg){
+  TraceBuffer *buf = arg;
+  pthread_mutex_lock(&trace_lock);
+  trace_write(buf);
+  buf->in_use = 0;
+  pthread_mutex_unlock(&trace_lock);
+  trace_buf = NULL;
+}
 
-static void * reuse_block_th(size_t size, Metadata * p, Metadata **first_free_block, Metadata ** last_free_block) {
-  if (p->size > size + sizeof(Metadata)) {
-    Metadata * remain = (Metadata *)((char *)p + sizeof(Metadata) + size);
-    remain->size = p->size - size - sizeof(Metadata);
-    remain->is_alloc = UNALLOC;
-    remain->next = p->next;
-    if(p == *last_free_block){
-      *last_free_block = remain;
-    }else{
-      if(p->next) p->next->prev = remain;
+static TraceBuffer *get_trace_buffer(void){
+  pthread_mutex_lock(&trace_lock);
+  TraceBuffer *buf = trace_buffers;
+  while(buf && buf->in_use){
+    buf = buf->next;
+  }
+  if(buf == NULL){
+    buf = mmap(NULL, sizeof(TraceBuffer), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(buf == MAP_FAILED){
+      pthread_mutex_unlock(&trace_lock);
+      return NULL;
     }
-    p->next = remain;
-    p->size = size;
-    remain->prev = p; // new added
+    buf->thread = trace_threads++;
+    buf->next = trace_buffers;
+    trace_buffers = buf;
   }
-  free_size -= p->size + sizeof(Metadata);
-  remove_block_th(p, first_free_block, last_free_block);
-  p->is_alloc = ALLOC;
-  return (char *)p + sizeof(Metadata);
+  buf->in_use = 1;
+  pthread_mutex_unlock(&trace_lock);
+  pthread_setspecific(trace_key, buf);
+  trace_buf = buf;
+  return buf;
 }
 
+static void trace_event(uint32_t op, void *ptr, size_t size){
+  TraceBuffer *buf = trace_buf ? trace_buf : get_trace_buffer();
+  if(buf == NULL) return;
+  // my_malloc_trace_stop waits for writing == 0 after trace_on is cleared
+  atomic_store(&buf->writing, 1);
+  if(atomic_load(&trace_on)){
+    TraceEvent *e = &buf->event[buf->num];
+    e->time = trace_now() - trace_start_ns;
+    e->ptr = (uintptr_t)ptr;
+    e->size = size;
+    e->thread = buf->thread;
+    e->op = op;
+    if(++buf->num == TRACE_BUF_NUM){
+      pthread_mutex_lock(&trace_lock);
+      trace_write(buf);
+      pthread_mutex_unlock(&trace_lock);
+    }
+  }
+  atomic_store_explicit(&buf->writing, 0, memory_order_release);
+}
 
-static void * allocate_block_th(size_t size) {
-  Metadata * new_block = my_sbrk_with_lock(size + sizeof(Metadata));
-  if(new_block == NULL){
-    return NULL;
+// start writing a trace to path, return -1 if a trace is running or the file cannot be created
+int my_malloc_trace_start(const char *path){
+  pthread_mutex_lock(&trace_lock);
+  if(trace_fd >= 0){
+    pthread_mutex_unlock(&trace_lock);
+    return -1;
+  }
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  TraceHeader header = {TRACE_MAGIC, TRACE_VERSION, sizeof(TraceEvent)};
+  if(fd < 0 || write(fd, &header, sizeof(header)) != sizeof(header)){
+    if(fd >= 0) close(fd);
+    pthread_mutex_unlock(&trace_lock);
+    return -1;
+  }
+  for(TraceBuffer *buf = trace_buffers; buf; buf = buf->next){
+    buf->num = 0;
   }
-  new_block->size = size;
-  new_block->is_alloc = ALLOC;
-  // new_block->prev = last_free_block; //shortcut
-  new_block->prev = NULL;
-  new_block->next = NULL;
-  return (void *)new_block + sizeof(Metadata);
+  trace_fd = fd;
+  trace_start_ns = trace_now();
+  atomic_store(&trace_on, 1);
+  pthread_mutex_unlock(&trace_lock);
+  return 0;
 }
 
-// different with verision 1 add block, it need to traverse to find its right positon
-static void add_block_th(Metadata * p, Metadata **first_free_block, Metadata ** last_free_block) {
-  if(*first_free_block == NULL){
-    *first_free_block = p;
-    *last_free_block = p;
-    p->prev = NULL;
-    p->next = NULL;
+// stop the trace and write the events left in the buffers of all threads
+void my_malloc_trace_stop(void){
+  pthread_mutex_lock(&trace_lock);
+  if(trace_fd < 0){
+    pthread_mutex_unlock(&trace_lock);
     return;
   }
-  if(p > *last_free_block){
-    (*last_free_block)->next = p;
-    p->next = NULL;
-    p->prev = *last_free_block;
-    *last_free_block = p;
-    return;
+  atomic_store(&trace_on, 0);
+  TraceBuffer *head = trace_buffers;
+  pthread_mutex_unlock(&trace_lock);
+  // a thread which has seen trace_on may still be adding its last event
+  for(TraceBuffer *buf = head; buf; buf = buf->next){
+    while(atomic_load(&buf->writing)) sched_yield();
   }
-  if(p < *first_free_block){
-    p->prev = NULL;
-    p->next = *first_free_block;
-    (*first_free_block) -> prev = p;
-    *first_free_block = p; 
-  }else{
-    Metadata *prev = *first_free_block;
-    while(prev->next && prev->next < p){
-      prev = prev->next;
-    }
-    if(prev->next){
-      prev->next->prev = p;
-      // p->next = prev->next;
-    }
-    p->next = prev->next;
-    p->prev = prev;
-    prev->next = p;
+  pthread_mutex_lock(&trace_lock);
+  for(TraceBuffer *buf = trace_buffers; buf; buf = buf->next){
+    trace_write(buf);
   }
+  if(trace_fd >= 0) close(trace_fd);
+  trace_fd = -1;
+  pthread_mutex_unlock(&trace_lock);
 }
 
+/*
+*
+*  Statistics: every thread adds to its own counters, only it writes them, so a relaxed load and
+*  store is enough and no cache line is shared. A reader sums the counters of all threads. Counters
+*  are never freed, those of an exited thread go on with the next new thread, so the sums stay right.
+*
+*/
+
+struct thread_stats {
+  atomic_long count[STAT_NUM]; // may be negative, another thread frees what this one malloced
+  atomic_long class_mallocs[MY_MALLOC_CLASS_NUM];
+  atomic_long latency[MY_MALLOC_OP_NUM][MY_MALLOC_LATENCY_NUM];
+  int in_use; // owned by a living thread, protected by stats_lock
+  struct thread_stats * next; // never freed, protected by stats_lock
+};
+typedef struct thread_stats ThreadStats;
 
-static Metadata* coalesc_th(Metadata *p, Metadata **first_free_block, Metadata ** last_free_block){
-    if(!p) return NULL;
-    if(p->next && (void*)p + p->size+sizeof(Metadata) == (void*)(p->next)){
-      p->size += sizeof(Metadata) + p->next->size;
-      remove_block_th(p->next, first_free_block, last_free_block);
+static ThreadStats stats_spare = {.in_use = 1}; // shared by threads which cannot map their own
+static ThreadStats * _Atomic stats_list = &stats_spare; // readers walk it without lock
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static __thread ThreadStats * stats_th = NULL;
+static atomic_int stats_latency_on = 0;
+
+// give the counters to the next thread when the thread exits
+static void stats_destructor(void *arg){
+  ThreadStats *s = arg;
+  pthread_mutex_lock(&stats_lock);
+  s->in_use = 0;
+  pthread_mutex_unlock(&stats_lock);
+  stats_th = NULL;
+}
+
+static void stats_init(void){
+  pthread_key_create(&stats_key, stats_destructor);
+}
+
+static ThreadStats *get_thread_stats(void){
+  if(stats_th) return stats_th;
+  pthread_once(&stats_once, stats_init);
+  pthread_mutex_lock(&stats_lock);
+  ThreadStats *s = atomic_load_explicit(&stats_list, memory_order_relaxed);
+  while(s && s->in_use){
+    s = s->next;
+  }
+  if(s == NULL){
+    s = mmap(NULL, sizeof(ThreadStats), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(s == MAP_FAILED){
+      pthread_mutex_unlock(&stats_lock);
+      return &stats_spare;
     }
-    return p;
+    s->next = atomic_load_explicit(&stats_list, memory_order_relaxed);
+    atomic_store_explicit(&stats_list, s, memory_order_release);
+  }
+  s->in_use = 1;
+  pthread_mutex_unlock(&stats_lock);
+  stats_th = s; // before pthread_setspecific, which may malloc
+  pthread_setspecific(stats_key, s);
+  return s;
 }
 
-void bf_free_th(void * ptr, Metadata **first_free_block, Metadata ** last_free_block) {
-  Metadata * p = (Metadata *)((char *)ptr - sizeof(Metadata));
-  p->is_alloc = UNALLOC;
-  free_size += p->size + sizeof(Metadata);
-  add_block_th(p, first_free_block, last_free_block);
-  if(p != *last_free_block)coalesc_th(p, first_free_block, last_free_block);
-  if(p != *first_free_block)coalesc_th(p->prev, first_free_block, last_free_block);
+static void stats_inc(atomic_long *c, long n){
+  atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n, memory_order_relaxed);
 }
 
+static void stat_add(int stat, long n){
+  stats_inc(&get_thread_stats()->count[stat], n);
+}
+
+// sum of a counter over all threads
+static unsigned long stat_sum(int stat){
+  long sum = 0;
+  for(ThreadStats *s = atomic_load_explicit(&stats_list, memory_order_acquire); s; s = s->next){
+    sum += atomic_load_explicit(&s->count[stat], memory_order_relaxed);
+  }
+  return sum > 0 ? sum : 0; // a free may be seen before the malloc of another thread
+}
+
+// lock m, counting the acquisition and if it waited for another thread
+static void lock_count(pthread_mutex_t *m){
+  if(pthread_mutex_trylock(m) != 0){
+    stat_add(STAT_CONTENDED, 1);
+    pthread_mutex_lock(m);
+  }
+  stat_add(STAT_LOCK, 1);
+}
+
+// start time of a call, 0 if latency is not recorded
+static uint64_t stats_begin(void){
+  return atomic_load_explicit(&stats_latency_on, memory_order_relaxed) ? trace_now() : 0;
+}
+
+// count a call of op which started at start, bucket i of the latency holds [2^i, 2^(i+1)) ns
+static void stats_end(ThreadStats *s, int op, uint64_t start){
+  if(start == 0) return;
+  uint64_t ns = trace_now() - start;
+  int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+  if(bucket >= MY_MALLOC_LATENCY_NUM) bucket = MY_MALLOC_LATENCY_NUM - 1;
+  stats_inc(&s->latency[op][bucket], 1);
+}
+
+// count a malloc / calloc / memalign of size which returned ptr
+static void stats_malloc(void *ptr, size_t size, uint64_t start){
+  ThreadStats *s = get_thread_stats();
+  stats_inc(&s->count[STAT_MALLOC], 1);
+  stats_inc(&s->class_mallocs[size <= 512 ? (size ? (size - 1) / 16 : 0) : MY_MALLOC_CLASS_NUM - 1], 1);
+  if(ptr) stats_inc(&s->count[STAT_IN_USE], ts_malloc_usable_size(ptr));
+  stats_end(s, MY_MALLOC_OP_MALLOC, start);
+}
+
+// count a free of a block with usable size
+static void stats_free(size_t size, uint64_t start){
+  ThreadStats *s = get_thread_stats();
+  stats_inc(&s->count[STAT_FREE_CALLS], 1);
+  stats_inc(&s->count[STAT_IN_USE], -(long)size);
+  stats_end(s, MY_MALLOC_OP_FREE, start);
+}
+
+// count a realloc of a block with usable size old to size, which returned ptr
+static void stats_realloc(size_t old, void *ptr, size_t size, uint64_t start){
+  ThreadStats *s = get_thread_stats();
+  stats_inc(&s->count[STAT_REALLOC], 1);
+  if(ptr) stats_inc(&s->count[STAT_IN_USE], (long)ts_malloc_usable_size(ptr) - (long)old);
+  else if(size == 0) stats_inc(&s->count[STAT_IN_USE], -(long)old); // freed, a failed one keeps the block
+  stats_end(s, MY_MALLOC_OP_REALLOC, start);
+}
+
+void my_malloc_stats_latency(int on){
+  atomic_store(&stats_latency_on, on != 0);
+}
 
-void * bf_malloc_th(size_t size, Metadata **first_free_block, Metadata ** last_free_block) {
-  Metadata * p = *first_free_block;
-  Metadata * best = NULL;
-  while (p != NULL) {
-    if (p->size >= size) {
-      if ((!best) || (p->size < best->size)) {
-        best = p;
-        if(best->size-size < DSIZE){
-            break; // use immediately
-        }
+void my_malloc_stats(MallocStats *stats){
+  long count[STAT_NUM] = {0};
+  memset(stats, 0, sizeof(*stats));
+  for(ThreadStats *s = atomic_load_explicit(&stats_list, memory_order_acquire); s; s = s->next){
+    for(int i = 0; i < STAT_NUM; i++){
+      count[i] += atomic_load_explicit(&s->count[i], memory_order_relaxed);
+    }
+    for(int i = 0; i < MY_MALLOC_CLASS_NUM; i++){
+      stats->class_mallocs[i] += atomic_load_explicit(&s->class_mallocs[i], memory_order_relaxed);
+    }
+    for(int op = 0; op < MY_MALLOC_OP_NUM; op++){
+      for(int i = 0; i < MY_MALLOC_LATENCY_NUM; i++){
+        stats->latency[op][i] += atomic_load_explicit(&s->latency[op][i], memory_order_relaxed);
       }
     }
-    p = p->next;
   }
-  if (best) {
-    return reuse_block_th(size, best,first_free_block, last_free_block);
+  for(int i = 0; i < STAT_NUM; i++){
+    if(count[i] < 0) count[i] = 0;
   }
-  else {
-    return allocate_block_th(size);
+  stats->heap_bytes = count[STAT_HEAP];
+  stats->mmap_bytes = count[STAT_MMAP];
+  stats->mapped_bytes = stats->heap_bytes + stats->mmap_bytes;
+  stats->mmap_blocks = count[STAT_MMAP_BLOCKS];
+  stats->in_use_bytes = count[STAT_IN_USE];
+  stats->free_bytes = count[STAT_FREE];
+  stats->free_blocks = count[STAT_FREE_BLOCKS];
+  stats->malloc_calls = count[STAT_MALLOC];
+  stats->free_calls = count[STAT_FREE_CALLS];
+  stats->realloc_calls = count[STAT_REALLOC];
+  stats->sbrk_calls = count[STAT_SBRK];
+  stats->mmap_calls = count[STAT_MMAP_CALLS];
+  stats->munmap_calls = count[STAT_MUNMAP];
+  stats->lock_acquisitions = count[STAT_LOCK];
+  stats->lock_contended = count[STAT_CONTENDED];
+}
+
+int my_malloc_stats_print(FILE *out, int json){
+  static const char *op_names[MY_MALLOC_OP_NUM] = {"malloc", "free", "realloc"};
+  MallocStats st;
+  my_malloc_stats(&st);
+  const struct {
+    const char *name;
+    unsigned long value;
+  } fields[] = {
+    {"mapped_bytes", st.mapped_bytes}, {"heap_bytes", st.heap_bytes}, {"mmap_bytes", st.mmap_bytes},
+    {"mmap_blocks", st.mmap_blocks}, {"in_use_bytes", st.in_use_bytes}, {"free_bytes", st.free_bytes},
+    {"free_blocks", st.free_blocks}, {"malloc_calls", st.malloc_calls}, {"free_calls", st.free_calls},
+    {"realloc_calls", st.realloc_calls}, {"sbrk_calls", st.sbrk_calls}, {"mmap_calls", st.mmap_calls},
+    {"munmap_calls", st.munmap_calls}, {"lock_acquisitions", st.lock_acquisitions},
+    {"lock_contended", st.lock_contended},
+  };
+  int n = sizeof(fields) / sizeof(fields[0]);
+  int res = 0;
+  if(json) res |= fputs("{", out);
+  for(int i = 0; i < n; i++){
+    res |= fprintf(out, json ? "\"%s\":%lu," : "%s %lu\n", fields[i].name, fields[i].value);
+  }
+  res |= fprintf(out, json ? "\"class_mallocs\":[" : "class_mallocs");
+  for(int i = 0; i < MY_MALLOC_CLASS_NUM; i++){
+    res |= fprintf(out, "%s%lu", json ? (i ? "," : "") : " ", st.class_mallocs[i]);
+  }
+  res |= fprintf(out, json ? "],\"latency\":{" : "\n");
+  for(int op = 0; op < MY_MALLOC_OP_NUM; op++){
+    if(json){
+      res |= fprintf(out, "%s\"%s\":[", op ? "," : "", op_names[op]);
+    }else{
+      res |= fprintf(out, "latency_%s", op_names[op]);
+    }
+    for(int i = 0; i < MY_MALLOC_LATENCY_NUM; i++){
+      res |= fprintf(out, "%s%lu", json ? (i ? "," : "") : " ", st.latency[op][i]);
+    }
+    res |= fprintf(out, json ? "]" : "\n");
+  }
+  if(json) res |= fputs("}}\n", out);
+  return res < 0 ? -1 : 0;
+}
+
+/*
+*
+*  Heap profile: every thread counts down the bytes it mallocs and samples the malloc which
+*  takes the count below zero, the next count is drawn from an exponential distribution with
+*  mean profile_rate, so every byte has the same chance to be sampled. A sampled block gets its
+*  own mapping, so free only looks a block up in the table of live samples when it is MMAPPED.
+*  The fast path is one subtraction and branch, built with -DMY_MALLOC_NO_PROFILE it is gone.
+*
+*/
+
+#ifndef MY_MALLOC_NO_PROFILE
+
+#define PROFILE_DEPTH 32 // max frames of a stack
+#define PROFILE_TABLE_NUM 4096 // buckets of live samples
+#define PROFILE_CHUNK (64 * 1024) // samples are mapped this many bytes at a time
+#define PROFILE_RATE (512 * 1024) // default mean bytes between samples
+#define PROFILE_RECHECK (1024 * 1024) // bytes between two checks of a thread while sampling is off
+
+struct profile_sample {
+  void *ptr; // payload of the real block
+  size_t size; // size asked by the program
+  uint64_t hash; // of the stack
+  int depth;
+  void *stack[PROFILE_DEPTH];
+  struct profile_sample * next; // in the bucket, or in the spare list
+};
+typedef struct profile_sample ProfileSample;
+
+static atomic_size_t profile_rate = 0; // 0 if sampling is off
+static atomic_long profile_live = 0; // live samples, free skips the table while it is 0
+static ProfileSample * profile_table[PROFILE_TABLE_NUM]; // protected by profile_lock
+static ProfileSample * profile_spare = NULL; // protected by profile_lock
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread long profile_left = 0; // bytes this thread mallocs before the next sample
+static __thread int profile_armed = 0; // profile_left was drawn while sampling is on
+static __thread int profile_busy = 0; // mallocs of backtrace are not sampled
+static __thread uint64_t profile_seed = 0;
+
+static int profile_should_sample(void);
+static void *profile_malloc(size_t size);
+static void profile_remove(void *ptr);
+
+// size bytes are malloced, if it is sampled
+#define PROFILE_SAMPLE(size) ((profile_left -= (long)(size)) < 0 && profile_should_sample())
+// a block is freed or moved
+#define PROFILE_FREE(ptr) \
+  do{ if(atomic_load_explicit(&profile_live, memory_order_relaxed) && (GET_ATOMIC(get_block(ptr)) & FLAGS) == MMAPPED) \
+    profile_remove(ptr); }while(0)
+
+static size_t profile_bucket(void *ptr){
+  return ((uintptr_t)ptr >> 12) % PROFILE_TABLE_NUM; // sampled blocks start one page apart
+}
+
+// bytes until the next sample, exponential with mean rate
+static long profile_next(size_t rate){
+  if(profile_seed == 0) profile_seed = (uintptr_t)&profile_seed ^ trace_now();
+  profile_seed ^= profile_seed << 13; // xorshift64
+  profile_seed ^= profile_seed >> 7;
+  profile_seed ^= profile_seed << 17;
+  double u = ((profile_seed >> 11) + 1) * (1.0 / 9007199254740992.0); // (0, 1]
+  double next = -log(u) * rate;
+  return next < LONG_MAX / 2 ? (long)next + 1 : LONG_MAX / 2;
+}
+
+// the count of this thread is below zero, draw the next one
+static int profile_should_sample(void){
+  size_t rate = atomic_load_explicit(&profile_rate, memory_order_relaxed);
+  if(rate == 0 || profile_busy){
+    profile_left = PROFILE_RECHECK;
+    profile_armed = 0;
+    return 0;
   }
+  // the first count of a thread is drawn without sampling, it does not start at 0
+  int armed = profile_armed;
+  profile_armed = 1;
+  profile_left = profile_next(rate);
+  return armed;
 }
 
+// record a live sample of size at ptr with the stack of the caller
+static __attribute__((noinline)) void profile_add(void *ptr, size_t size){
+  void *stack[PROFILE_DEPTH + 1];
+  profile_busy = 1;
+  int depth = backtrace(stack, PROFILE_DEPTH + 1) - 1; // without this function
+  profile_busy = 0;
+  if(depth < 0) depth = 0;
+  uint64_t hash = 14695981039346656037ull; // FNV-1a
+  for(int i = 0; i < depth; i++){
+    hash = (hash ^ (uintptr_t)stack[i + 1]) * 1099511628211ull;
+  }
+  pthread_mutex_lock(&profile_lock);
+  if(profile_spare == NULL){
+    char *chunk = mmap(NULL, PROFILE_CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(chunk == MAP_FAILED){
+      pthread_mutex_unlock(&profile_lock);
+      return;
+    }
+    for(size_t i = 0; i + sizeof(ProfileSample) <= PROFILE_CHUNK; i += sizeof(ProfileSample)){
+      ProfileSample *s = (ProfileSample *)(chunk + i);
+      s->next = profile_spare;
+      profile_spare = s;
+    }
+  }
+  ProfileSample *s = profile_spare;
+  profile_spare = s->next;
+  s->ptr = ptr;
+  s->size = size;
+  s->hash = hash;
+  s->depth = depth;
+  memcpy(s->stack, stack + 1, depth * sizeof(void *));
+  ProfileSample **bucket = &profile_table[profile_bucket(ptr)];
+  s->next = *bucket;
+  *bucket = s;
+  atomic_fetch_add_explicit(&profile_live, 1, memory_order_relaxed);
+  pthread_mutex_unlock(&profile_lock);
+}
 
-void *ts_malloc_nolock(size_t size){
-  return bf_malloc_th(size, &first_free_block_th, &last_free_block_th);
-  // return bf_malloc(size, With_sbk_lock, &first_free_block_th, &last_free_block_th);
+// drop the sample of the block at ptr, if it is one
+static void profile_remove(void *ptr){
+  ptr = (char *)get_block(ptr) + HEAD_SIZE;
+  pthread_mutex_lock(&profile_lock);
+  for(ProfileSample **s = &profile_table[profile_bucket(ptr)]; *s; s = &(*s)->next){
+    if((*s)->ptr == ptr){
+      ProfileSample *found = *s;
+      *s = found->next;
+      found->next = profile_spare;
+      profile_spare = found;
+      atomic_fetch_sub_explicit(&profile_live, 1, memory_order_relaxed);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&profile_lock);
+}
+
+// malloc of both versions for a sampled size, the block gets its own mapping
+static void *profile_malloc(size_t size){
+  void *ptr = mmap_block(size);
+  if(ptr) profile_add(ptr, size);
+  return ptr;
+}
+
+// realloc for a sampled size, the block always moves to its own mapping
+static void *profile_realloc(void *ptr, size_t size, void (*free_fn)(void *)){
+  if(size == 0) return realloc_block(ptr, size, profile_malloc, free_fn);
+  void *res = profile_malloc(size);
+  if(res && ptr){
+    size_t old = ts_malloc_usable_size(ptr);
+    memcpy(res, ptr, old < size ? old : size);
+    free_fn(ptr);
+  }
+  return res;
+}
+
+int my_malloc_profile_start(size_t rate){
+  void *stack[1];
+  backtrace(stack, 1); // the first call loads libgcc and mallocs, not while sampling
+  atomic_store(&profile_rate, rate ? rate : PROFILE_RATE);
+  return 0;
+}
+
+void my_malloc_profile_stop(void){
+  atomic_store(&profile_rate, 0);
+}
+
+// copy of the samples of one stack, taken under profile_lock and printed without it
+typedef struct {
+  ProfileSample sample; // the first sample of the stack
+  size_t objects;
+  size_t bytes;
+  double estimate; // bytes the samples stand for
+} ProfileSite;
+
+// bytes a sample of size stands for, it is sampled with probability 1 - e^(-size / rate)
+static double profile_scale(size_t size, size_t rate){
+  double p = 1 - exp(-(double)size / rate);
+  return p > 0 ? size / p : size;
+}
+
+int my_malloc_profile_dump(FILE *out, int pprof){
+  size_t rate = atomic_load(&profile_rate);
+  if(rate == 0) rate = PROFILE_RATE;
+  pthread_mutex_lock(&profile_lock);
+  // sites in an open addressing table keyed by the hash of stack, at most half full
+  size_t num = 16;
+  while(num < 2 * (size_t)atomic_load(&profile_live)) num *= 2;
+  size_t length = num * sizeof(ProfileSite);
+  ProfileSite *sites = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(sites == MAP_FAILED){
+    pthread_mutex_unlock(&profile_lock);
+    return -1;
+  }
+  for(int i = 0; i < PROFILE_TABLE_NUM; i++){
+    for(ProfileSample *s = profile_table[i]; s; s = s->next){
+      size_t j = s->hash & (num - 1);
+      while(sites[j].objects && (sites[j].sample.hash != s->hash || sites[j].sample.depth != s->depth ||
+            memcmp(sites[j].sample.stack, s->stack, s->depth * sizeof(void *)))){
+        j = (j + 1) & (num - 1);
+      }
+      if(sites[j].objects == 0) sites[j].sample = *s;
+      sites[j].objects++;
+      sites[j].bytes += s->size;
+      sites[j].estimate += profile_scale(s->size, rate);
+    }
+  }
+  pthread_mutex_unlock(&profile_lock);
+  // the largest estimate first
+  size_t n = 0;
+  for(size_t i = 0; i < num; i++){
+    if(sites[i].objects) sites[n++] = sites[i];
+  }
+  for(size_t i = 1; i < n; i++){
+    ProfileSite site = sites[i];
+    size_t j = i;
+    for(; j > 0 && sites[j - 1].estimate < site.estimate; j--) sites[j] = sites[j - 1];
+    sites[j] = site;
+  }
+  size_t objects = 0, bytes = 0;
+  double estimate = 0;
+  for(size_t i = 0; i < n; i++){
+    objects += sites[i].objects;
+    bytes += sites[i].bytes;
+    estimate += sites[i].estimate;
+  }
+  int res = 0;
+  if(pprof){
+    // legacy heap profile of gperftools, pprof scales the samples by the rate itself
+    res |= fprintf(out, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n", objects, bytes, objects, bytes, rate);
+    for(size_t i = 0; i < n; i++){
+      res |= fprintf(out, "%zu: %zu [%zu: %zu] @", sites[i].objects, sites[i].bytes, sites[i].objects, sites[i].bytes);
+      for(int k = 0; k < sites[i].sample.depth; k++){
+        res |= fprintf(out, " %p", sites[i].sample.stack[k]);
+      }
+      res |= fputs("\n", out);
+    }
+    // pprof finds the binaries of the addresses in the maps
+    res |= fputs("\nMAPPED_LIBRARIES:\n", out);
+    int fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    char buf[4096];
+    ssize_t len;
+    while(fd >= 0 && (len = read(fd, buf, sizeof(buf))) > 0){
+      if(fwrite(buf, 1, len, out) != (size_t)len) res = -1;
+    }
+    if(fd >= 0) close(fd);
+  }else{
+    res |= fprintf(out, "%.0f bytes estimated in use, %zu bytes in %zu samples, rate %zu\n", estimate, bytes, objects, rate);
+    for(size_t i = 0; i < n; i++){
+      res |= fprintf(out, "\n%.0f bytes estimated, %zu bytes in %zu samples\n", sites[i].estimate, sites[i].bytes, sites[i].objects);
+      // the symbols are written straight to the file, backtrace_symbols would malloc
+      fflush(out);
+      backtrace_symbols_fd(sites[i].sample.stack, sites[i].sample.depth, fileno(out));
+    }
+  }
+  munmap(sites, length);
+  if(fflush(out) != 0) res = -1;
+  return res < 0 ? -1 : 0;
+}
+
+// write the profile to path when the program exits, set by MY_MALLOC_PROFILE
+static const char *profile_path = NULL;
+
+static void profile_write(void){
+  FILE *out = fopen(profile_path, "w");
+  if(out == NULL) return;
+  my_malloc_profile_dump(out, 1);
+  fclose(out);
+}
+
+#else
+
+#define PROFILE_SAMPLE(size) 0
+#define PROFILE_FREE(ptr) do{}while(0)
+
+static void *profile_malloc(size_t size){
+  return NULL;
+}
+
+static void *profile_realloc(void *ptr, size_t size, void (*free_fn)(void *)){
+  return NULL;
+}
+
+int my_malloc_profile_start(size_t rate){
+  return -1;
+}
+
+void my_malloc_profile_stop(void){
+}
+
+int my_malloc_profile_dump(FILE *out, int pprof){
+  return -1;
+}
+
+#endif
+
+/*
+*
+*  Huge pages: the break cannot be aligned or advised as a whole, so with huge pages on every thread
+*  of the lock version mallocs from a region arena, and heaps without lock carve their chunks from
+*  their region as before. A region starts at a multiple of HUGE_PAGE and is advised MADV_HUGEPAGE,
+*  so the first touch of every 2 MB fills a whole huge page, and blocks bumped from the top stay in
+*  it until it is full. Trimming gives back whole huge pages only, so a page in use is never split.
+*  Without transparent huge pages in the kernel the regions are mapped as before.
+*
+*/
+
+// if the kernel backs memory advised MADV_HUGEPAGE with huge pages
+static int huge_pages_supported(void){
+  char buf[128];
+  int fd = open("/sys/kernel/mm/transparent_hugepage/enabled", O_RDONLY | O_CLOEXEC);
+  if(fd < 0) return 0;
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if(n <= 0) return 0;
+  buf[n] = 0;
+  return strstr(buf, "[always]") != NULL || strstr(buf, "[madvise]") != NULL;
+}
+
+// only reserve address space, pages are taken when they are touched. With huge pages on the region
+// is aligned to HUGE_PAGE and advised to use them, *huge tells if it is
+static void * reserve_region(size_t length, int *huge){
+  size_t extra = huge_pages ? HUGE_PAGE : 0;
+  void *res = mmap(NULL, length + extra, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  stat_add(STAT_MMAP_CALLS, 1);
+  *huge = 0;
+  if(res == MAP_FAILED) return NULL;
+  if(extra){
+    void *aligned = (void *)(((uintptr_t)res + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1));
+    if(aligned > res) munmap(res, aligned - res);
+    if(res + extra > aligned) munmap(aligned + length, res + extra - aligned);
+    res = aligned;
+    *huge = madvise(res, length, MADV_HUGEPAGE) == 0;
+  }
+  return res;
+}
+
+// if [start, end) overlaps the arena regions or the region of a heap without lock
+static int in_regions(uintptr_t start, uintptr_t end){
+  uintptr_t base = (uintptr_t)arena_region;
+  if(base && start < base + (arena_num - 1) * ARENA_REGION && end > base) return 1;
+  for(ThreadHeap *h = atomic_load_explicit(&heap_list, memory_order_acquire); h; h = h->next_heap){
+    base = (uintptr_t)h->region;
+    if(base && start < base + HEAP_REGION && end > base) return 1;
+  }
+  return 0;
+}
+
+// bytes of the regions backed by huge pages, AnonHugePages of their mappings in /proc/self/smaps,
+// read without stdio so it mallocs nothing
+unsigned long my_malloc_huge_bytes(void){
+  int fd = open("/proc/self/smaps", O_RDONLY | O_CLOEXEC);
+  if(fd < 0) return 0;
+  char buf[4096];
+  size_t len = 0;
+  int ours = 0;
+  unsigned long total = 0;
+  ssize_t n;
+  while((n = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0){
+    len += n;
+    buf[len] = 0;
+    char *line = buf, *nl;
+    while((nl = strchr(line, '\n')) != NULL){
+      *nl = 0;
+      unsigned long start, end, kb;
+      if(sscanf(line, "%lx-%lx ", &start, &end) == 2) ours = in_regions(start, end);
+      else if(ours && sscanf(line, "AnonHugePages: %lu kB", &kb) == 1) total += kb * 1024;
+      line = nl + 1;
+    }
+    len = buf + len - line;
+    if(len == sizeof(buf) - 1) len = 0; // a line longer than the buffer is skipped
+    memmove(buf, line, len);
+  }
+  close(fd);
+  return total;
+}
+
+/*
+*
+*  Arenas of the lock version: a thread mallocs from its own arena (given round robin) and
+*  moves to another one when it is locked, a block is freed to the arena whose region holds it.
+*
+*/
+
+static void arena_init(void){
+  int num = arena_conf;
+  const char *env = getenv("MY_MALLOC_ARENAS");
+  if(num == 0 && env) num = atoi(env);
+  if(num == 0) num = ARENA_PER_CPU * sysconf(_SC_NPROCESSORS_ONLN);
+  if(num < 1) num = 1;
+  if(num > ARENA_MAX) num = ARENA_MAX;
+  // with huge pages the threads only malloc from regions, arena 0 on sbrk takes what they cannot hold
+  int first = huge_pages != 0;
+  if(first && num < ARENA_MAX) num++;
+  if(num > 1){
+    int huge;
+    void *res = reserve_region((num - 1) * ARENA_REGION, &huge);
+    if(res == NULL) num = 1;
+    else arena_region = res;
+    if(!huge) first = 0;
+  }
+  for(int i = 1; i < num; i++){
+    Arena *a = &arenas[i];
+    pthread_mutex_init(&a->lock, NULL);
+    a->base = arena_region + (i - 1) * ARENA_REGION;
+    a->top = a->base + HEAD_SIZE; // headers sit one word before an aligned address
+    a->high = a->top;
+  }
+  arena_first = num > 1 ? first : 0;
+  arena_num = num;
+}
+
+static Arena * get_arena(void){
+  if(arena_th == NULL){
+    pthread_once(&arena_once, arena_init);
+    unsigned int next = atomic_fetch_add_explicit(&arena_next, 1, memory_order_relaxed);
+    arena_th = &arenas[arena_first + next % (arena_num - arena_first)];
+  }
+  return arena_th;
+}
+
+// the arena of block p, from its address alone
+static Arena * arena_of(void *p){
+  if(p >= arena_region && p < arena_region + (arena_num - 1) * ARENA_REGION){
+    return &arenas[(p - arena_region) / ARENA_REGION + 1];
+  }
+  return arenas;
+}
+
+// lock the arena of current thread, or the first one after it which is not locked,
+// or wait for the arena of current thread if all are locked. The thread keeps the arena it gets
+static Arena * lock_arena(void){
+  Arena *a = get_arena();
+  int n = arena_num - arena_first;
+  for(int i = 0; i < n; i++){
+    Arena *b = &arenas[arena_first + (a - arenas - arena_first + i) % n];
+    if(pthread_mutex_trylock(&b->lock) == 0){
+      stat_add(STAT_LOCK, 1);
+      arena_th = b;
+      return b;
+    }
+  }
+  lock_count(&a->lock);
+  return a;
+}
+
+// the region of a is full: unlock it and lock arena 0, which grows with sbrk
+static Arena * fall_back(Arena *a){
+  pthread_mutex_unlock(&a->lock);
+  lock_count(&arenas[0].lock);
+  return arenas;
+}
+
+int ts_set_arena_num(unsigned int num){
+  if(num == 0 || num > ARENA_MAX) return -1;
+  arena_conf = num;
+  pthread_once(&arena_once, arena_init);
+  return arena_num - arena_first == (int)num ? 0 : -1;
+}
+
+int ts_set_huge_pages(int on){
+  if(on && !huge_pages_supported()) return -1;
+  huge_pages = on;
+  pthread_once(&arena_once, arena_init);
+  return arena_first == (on != 0) ? 0 : -1;
+}
+
+/*
+*
+*  Thread cache in front of the lock version
+*
+*  Every thread keeps the small blocks it freed in bins (one bin for every CACHE_ALIGN bytes).
+*  Cached blocks stay allocated from the view of the shared list, so no other thread touches them.
+*  A bin is flushed to the lock-free stack of its class, and refilled from it, the arenas are
+*  only locked when the stack is full / empty, then in batch with one lock acquisition.
+*
+*/
+
+#define CACHE_ALIGN 16
+#define CACHE_MAX_SIZE 512 // blocks larger than it go to the shared list directly
+#define CACHE_BIN_NUM (CACHE_MAX_SIZE / CACHE_ALIGN)
+#define CACHE_BIN_LIMIT 64 // default max number of blocks in a bin
+#define CACHE_BIN_SIZE(index) (((index) + 1) * CACHE_ALIGN + HEAD_SIZE) // the block sizes align gives
+
+struct thread_cache {
+  Metadata * bin[CACHE_BIN_NUM]; // linked by next, blocks in bin i have size >= CACHE_BIN_SIZE(i)
+  unsigned int count[CACHE_BIN_NUM];
+};
+typedef struct thread_cache ThreadCache;
+
+static __thread ThreadCache cache_th;
+static __thread int cache_registered = 0;
+static unsigned int cache_bin_limit[CACHE_BIN_NUM];
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+static void cache_flush(ThreadCache *cache, int index, unsigned int keep);
+
+/*
+*
+*  Lock-free stacks of the cache classes (Treiber stack): blocks freed by one thread and malloced
+*  by another go through them without any lock. A node is a whole batch of a flushed bin, linked
+*  by next as in the bin, and its first block links the next batch by prev, so a flush / refill
+*  is one CAS. The top word packs the first block (low STACK_PTR_BITS bits) and a tag which every
+*  pop bumps, so a pop which read the top and its link before other threads popped it and pushed
+*  it back fails its CAS instead of installing a stale link (ABA). Blocks in a stack stay
+*  allocated from the view of the arenas.
+*
+*/
+
+#define STACK_PTR_BITS 48 // user space addresses of x86-64 / aarch64 fit in 48 bits
+#define STACK_PTR_MASK (((uint64_t)1 << STACK_PTR_BITS) - 1)
+#define STACK_MAX_BYTES (512 * 1024) // max bytes of blocks in the stack of a class
+
+struct class_stack {
+  _Atomic uint64_t top; // tag << STACK_PTR_BITS | first block of the first batch
+  atomic_uint count; // blocks of all batches
+} __attribute__((aligned(64)));
+typedef struct class_stack ClassStack;
+
+static ClassStack class_stack[CACHE_BIN_NUM];
+
+// push the batch of num blocks starting at p onto the stack of class index, return 0 if the stack is full
+static int stack_push(int index, Metadata *p, unsigned int num){
+  ClassStack *s = &class_stack[index];
+  if(atomic_fetch_add_explicit(&s->count, num, memory_order_relaxed) + num > STACK_MAX_BYTES / CACHE_BIN_SIZE(index)){
+    atomic_fetch_sub_explicit(&s->count, num, memory_order_relaxed);
+    return 0;
+  }
+  uint64_t top = atomic_load_explicit(&s->top, memory_order_relaxed);
+  do{
+    p->prev = (Metadata *)(uintptr_t)(top & STACK_PTR_MASK);
+  }while(!atomic_compare_exchange_weak_explicit(&s->top, &top, (top & ~STACK_PTR_MASK) | (uintptr_t)p,
+                                                memory_order_release, memory_order_relaxed));
+  return 1;
+}
+
+// pop the first batch of the stack of class index, NULL if it is empty
+static Metadata *stack_pop(int index){
+  ClassStack *s = &class_stack[index];
+  Metadata *p;
+  // seq_cst with the check in trim_top_lock: a block this pop can read is not trimmed
+  atomic_fetch_add(&stack_readers, 1);
+  uint64_t top = atomic_load(&s->top);
+  do{
+    p = (Metadata *)(uintptr_t)(top & STACK_PTR_MASK);
+    if(p == NULL) break;
+    // the link may be stale if p is popped meanwhile, then the tag has changed and the CAS fails
+    uint64_t next = (uintptr_t)p->prev;
+    if(atomic_compare_exchange_weak_explicit(&s->top, &top, (((top >> STACK_PTR_BITS) + 1) << STACK_PTR_BITS) | next,
+                                             memory_order_acquire, memory_order_acquire)) break;
+  }while(1);
+  atomic_fetch_sub_explicit(&stack_readers, 1, memory_order_release);
+  return p;
+}
+
+// give the blocks of a batch back to the arenas they come from
+static void free_batch(Metadata *p){
+  Arena *a = NULL;
+  for(Metadata *next; p; p = next){
+    next = p->next;
+    if(arena_of(p) != a){
+      if(a) pthread_mutex_unlock(&a->lock);
+      a = arena_of(p);
+      lock_count(&a->lock);
+    }
+    bf_free((char *)p + HEAD_SIZE, No_sbk_lock, a);
+  }
+  if(a) pthread_mutex_unlock(&a->lock);
+}
+
+// give the blocks of all stacks back to their arenas
+static void stack_drain(void){
+  for(int i = 0; i < CACHE_BIN_NUM; i++){
+    Metadata *p;
+    while((p = stack_pop(i)) != NULL){
+      for(Metadata *q = p; q; q = q->next){
+        atomic_fetch_sub_explicit(&class_stack[i].count, 1, memory_order_relaxed);
+      }
+      free_batch(p);
+    }
+  }
+}
+
+// flush all bins when the thread exits, a later destructor of the thread which frees
+// registers the cache again, so its blocks are flushed in the next round
+static void cache_destructor(void *arg){
+  ThreadCache *cache = arg;
+  for(int i = 0; i < CACHE_BIN_NUM; i++){
+    if(cache->count[i]) cache_flush(cache, i, 0);
+  }
+  cache_registered = 0;
+}
+
+static void cache_init(void){
+  pthread_key_create(&cache_key, cache_destructor);
+  for(int i = 0; i < CACHE_BIN_NUM; i++){
+    if(cache_bin_limit[i] == 0) cache_bin_limit[i] = CACHE_BIN_LIMIT;
+  }
+}
+
+static ThreadCache *get_cache(void){
+  if(!cache_registered){
+    pthread_once(&cache_once, cache_init);
+    pthread_setspecific(cache_key, &cache_th);
+    cache_registered = 1;
+  }
+  return &cache_th;
+}
+
+// the smallest bin whose blocks can hold size
+static int cache_malloc_index(size_t size){
+  if(size <= CACHE_BIN_SIZE(0)) return 0;
+  return (size - HEAD_SIZE + CACHE_ALIGN - 1) / CACHE_ALIGN - 1;
+}
+
+// the largest bin whose size is not larger than block size
+static int cache_free_index(size_t size){
+  return (size - HEAD_SIZE) / CACHE_ALIGN - 1;
+}
+
+// push the blocks over keep onto the stack of the class as one batch, they go back to
+// the arenas they come from when the stack is full
+static void cache_flush(ThreadCache *cache, int index, unsigned int keep){
+  if(cache->count[index] <= keep) return;
+  unsigned int num = cache->count[index] - keep;
+  Metadata *first = cache->bin[index], *last = first;
+  for(unsigned int i = 1; i < num; i++){
+    last = last->next;
+  }
+  cache->bin[index] = last->next;
+  cache->count[index] = keep;
+  last->next = NULL;
+  if(!stack_push(index, first, num)) free_batch(first);
+}
+
+// take a batch from the stack of the class, or half of the bin limit blocks from the arena
+// if it is empty, return one of them (the bin is empty)
+static void *cache_refill(ThreadCache *cache, int index){
+  unsigned int num = cache_bin_limit[index] / 2;
+  if(num == 0) num = 1;
+  Metadata *first = stack_pop(index);
+  if(first){
+    cache->bin[index] = first->next;
+    for(Metadata *p = first->next; p; p = p->next){
+      cache->count[index]++;
+    }
+    atomic_fetch_sub_explicit(&class_stack[index].count, cache->count[index] + 1, memory_order_relaxed);
+    return (char *)first + HEAD_SIZE;
+  }
+  Arena *a = lock_arena();
+  void *res = bf_malloc(CACHE_BIN_SIZE(index), No_sbk_lock, a);
+  if(res == NULL && a != arenas){
+    a = fall_back(a);
+    res = bf_malloc(CACHE_BIN_SIZE(index), No_sbk_lock, a);
+  }
+  for(unsigned int i = 1; res && i < num; i++){
+    void *ptr = bf_malloc(CACHE_BIN_SIZE(index), No_sbk_lock, a);
+    if(ptr == NULL) break;
+    Metadata *p = (Metadata *)((char *)ptr - HEAD_SIZE);
+    p->next = cache->bin[index];
+    cache->bin[index] = p;
+    cache->count[index]++;
+  }
+  pthread_mutex_unlock(&a->lock);
+  return res;
+}
+
+int ts_set_cache_limit(size_t size, unsigned int limit){
+  if(size > CACHE_MAX_SIZE) return -1;
+  pthread_once(&cache_once, cache_init);
+  cache_bin_limit[cache_malloc_index(size)] = limit;
+  return 0;
+}
+
+static void * malloc_lock(size_t size) {
+  if(is_mmap_size(size)) return mmap_block(size);
+  if(size <= CACHE_MAX_SIZE){
+    ThreadCache *cache = get_cache();
+    int index = cache_malloc_index(size);
+    if(cache->bin[index]){
+      Metadata *p = cache->bin[index];
+      cache->bin[index] = p->next;
+      cache->count[index]--;
+      p->next = NULL;
+      return (char *)p + HEAD_SIZE;
+    }
+    if(cache_bin_limit[index]) return cache_refill(cache, index);
+  }
+  Arena *a = lock_arena();
+  void * p = bf_malloc(size, No_sbk_lock, a);
+  if(p == NULL && a != arenas){
+    a = fall_back(a);
+    p = bf_malloc(size, No_sbk_lock, a);
+  }
+  pthread_mutex_unlock(&a->lock);
+  return p;
+}
+static void free_lock(void * ptr) {
+  if(ptr == NULL) return;
+  Metadata *p = get_block(ptr);
+  ptr = (char *)p + HEAD_SIZE;
+  size_t head = GET_ATOMIC(p);
+  if((head & FLAGS) == MMAPPED){
+    munmap_block(p);
+    return;
+  }
+  size_t size = head & ~FLAGS;
+  if(size >= CACHE_BIN_SIZE(0) && size < CACHE_BIN_SIZE(CACHE_BIN_NUM)){
+    ThreadCache *cache = get_cache();
+    int index = cache_free_index(size);
+    if(cache_bin_limit[index]){
+      p->next = cache->bin[index];
+      cache->bin[index] = p;
+      if(++cache->count[index] > cache_bin_limit[index]){
+        cache_flush(cache, index, cache_bin_limit[index] / 2);
+      }
+      return;
+    }
+  }
+  Arena *a = arena_of(p);
+  lock_count(&a->lock);
+  bf_free(ptr, No_sbk_lock, a);
+  pthread_mutex_unlock(&a->lock);
+}
+// free with the size given to malloc: a small block goes to the bin of its size without
+// working out the class from the header, flags are those of the header read by the caller
+static void free_sized_lock(void * ptr, size_t size, size_t flags) {
+  Metadata *p = (Metadata *)((char *)ptr - HEAD_SIZE);
+  if(size > CACHE_MAX_SIZE || (flags & (MMAPPED | ALIGNED))){
+    free_lock(ptr);
+    return;
+  }
+  int index = cache_malloc_index(size); // the block is at least as large as the blocks of the bin
+  if(cache_bin_limit[index] == 0){
+    free_lock(ptr);
+    return;
+  }
+  ThreadCache *cache = get_cache();
+  p->next = cache->bin[index];
+  cache->bin[index] = p;
+  if(++cache->count[index] > cache_bin_limit[index]){
+    cache_flush(cache, index, cache_bin_limit[index] / 2);
+  }
+}
+
+static size_t malloc_batch_lock(size_t size, size_t num, void **ptrs){
+  if(is_mmap_size(size)){
+    for(size_t i = 0; i < num; i++){
+      if((ptrs[i] = mmap_block(size)) == NULL) return i;
+    }
+    return num;
+  }
+  Arena *a = lock_arena();
+  size_t done = bf_malloc_batch(size, num, ptrs, a);
+  if(done < num && a != arenas){
+    a = fall_back(a);
+    done += bf_malloc_batch(size, num - done, ptrs + done, a);
+  }
+  pthread_mutex_unlock(&a->lock);
+  return done;
+}
+
+static int cmp_ptr(const void *a, const void *b){
+  uintptr_t x = (uintptr_t)*(void * const *)a, y = (uintptr_t)*(void * const *)b;
+  return (x > y) - (x < y);
+}
+
+// blocks in their own mapping and aligned ones are freed one by one, the others are sorted by
+// address and freed with one lock of every arena they come from
+static void free_batch_lock(void **ptrs, size_t num){
+  size_t n = 0;
+  for(size_t i = 0; i < num; i++){
+    if(ptrs[i] == NULL) continue;
+    int flags = GET_ATOMIC((char *)ptrs[i] - HEAD_SIZE) & FLAGS;
+    if(flags == MMAPPED || flags == ALIGNED) free_lock(ptrs[i]);
+    else ptrs[n++] = ptrs[i];
+  }
+  qsort(ptrs, n, sizeof(void *), cmp_ptr);
+  // the blocks of an arena are next to each other after sorting, region arenas do not overlap
+  for(size_t i = 0; i < n; ){
+    Arena *a = arena_of((char *)ptrs[i] - HEAD_SIZE);
+    size_t j = i + 1;
+    while(j < n && arena_of((char *)ptrs[j] - HEAD_SIZE) == a) j++;
+    lock_count(&a->lock);
+    bf_free_batch(ptrs + i, j - i, a);
+    pthread_mutex_unlock(&a->lock);
+    i = j;
+  }
+}
+
+static void * realloc_lock(void * ptr, size_t size) {
+  if(ptr && size){
+    Metadata *p = (Metadata *)((char *)ptr - HEAD_SIZE);
+    int flags = GET_ATOMIC(p) & FLAGS;
+    if(flags != MMAPPED && flags != ALIGNED){
+      Arena *a = arena_of(p);
+      lock_count(&a->lock);
+      int resized = resize_block(a, p, align(size));
+      pthread_mutex_unlock(&a->lock);
+      if(resized) return ptr;
+    }
+  }
+  return realloc_block(ptr, size, malloc_lock, free_lock);
+}
+
+// the public functions of the lock version record the trace and statistics, the ones above do the work
+void * ts_malloc_lock(size_t size) {
+  uint64_t start = stats_begin();
+  void *ptr = PROFILE_SAMPLE(size) ? profile_malloc(size) : malloc_lock(size);
+  TRACE(TRACE_MALLOC, ptr, size);
+  stats_malloc(ptr, size, start);
+  return ptr;
+}
+
+void ts_free_lock(void * ptr) {
+  if(ptr == NULL) return;
+  uint64_t start = stats_begin();
+  size_t size = ts_malloc_usable_size(ptr);
+  TRACE(TRACE_FREE, ptr, 0);
+  PROFILE_FREE(ptr);
+  free_lock(ptr);
+  stats_free(size, start);
+}
+
+#ifdef MY_MALLOC_DEBUG
+#define SIZED_SLACK 128 // a block may be this much larger than its size: the tail too small to split stays in it
+// abort if size cannot be the size the block of ptr is malloced with, a mapped or aligned block may be
+// any larger than size
+static void check_size(void *ptr, size_t size){
+  size_t usable = ts_malloc_usable_size(ptr);
+  int flags = GET_ATOMIC((char *)ptr - HEAD_SIZE) & FLAGS;
+  if(size > usable || (flags != MMAPPED && flags != ALIGNED && usable - size >= SIZED_SLACK)){
+    fprintf(stderr, "my_malloc: sized free of %p with size %zu, the block holds %zu bytes\n", ptr, size, usable);
+    abort();
+  }
+}
+#define CHECK_SIZE(ptr, size) check_size(ptr, size)
+#else
+#define CHECK_SIZE(ptr, size) do{}while(0)
+#endif
+
+void ts_free_sized_lock(void * ptr, size_t size) {
+  if(ptr == NULL) return;
+  CHECK_SIZE(ptr, size);
+  uint64_t start = stats_begin();
+  size_t head = GET_ATOMIC((char *)ptr - HEAD_SIZE); // the usable size and the flags in one read
+  TRACE(TRACE_FREE, ptr, 0);
+  PROFILE_FREE(ptr);
+  free_sized_lock(ptr, size, head & FLAGS);
+  stats_free(head & ~FLAGS, start);
+}
+
+void * ts_realloc_lock(void * ptr, size_t size) {
+  uint64_t start = stats_begin();
+  size_t old = ts_malloc_usable_size(ptr);
+  TRACE(TRACE_REALLOC_BEGIN, ptr, size);
+  if(ptr) PROFILE_FREE(ptr);
+  ptr = PROFILE_SAMPLE(size) ? profile_realloc(ptr, size, free_lock) : realloc_lock(ptr, size);
+  TRACE(TRACE_REALLOC_END, ptr, size);
+  stats_realloc(old, ptr, size, start);
+  return ptr;
+}
+
+void * ts_calloc_lock(size_t num, size_t size) {
+  uint64_t start = stats_begin();
+  void *ptr = calloc_block(num, size, PROFILE_SAMPLE(num * size) ? profile_malloc : malloc_lock);
+  TRACE(TRACE_CALLOC, ptr, num * size);
+  stats_malloc(ptr, num * size, start);
+  return ptr;
+}
+
+void * ts_memalign_lock(size_t alignment, size_t size) {
+  uint64_t start = stats_begin();
+  void *ptr = memalign_block(alignment, size, PROFILE_SAMPLE(size) ? profile_malloc : malloc_lock);
+  TRACE(TRACE_MEMALIGN, ptr, size);
+  stats_malloc(ptr, size, start);
+  return ptr;
+}
+
+// the latency of a batch is not recorded, it is no single call
+size_t my_malloc_batch(size_t size, size_t num, void **ptrs){
+  size_t done = 0;
+  for(size_t i = 0; i < num; i++){
+    if(PROFILE_SAMPLE(size) && (ptrs[done] = profile_malloc(size)) != NULL) done++;
+  }
+  done += malloc_batch_lock(size, num - done, ptrs + done);
+  for(size_t i = 0; i < done; i++){
+    TRACE(TRACE_MALLOC, ptrs[i], size);
+    stats_malloc(ptrs[i], size, 0);
+  }
+  return done;
+}
+
+void my_free_batch(void **ptrs, size_t num){
+  for(size_t i = 0; i < num; i++){
+    if(ptrs[i] == NULL) continue;
+    TRACE(TRACE_FREE, ptrs[i], 0);
+    PROFILE_FREE(ptrs[i]);
+    stats_free(ts_malloc_usable_size(ptrs[i]), 0);
+  }
+  free_batch_lock(ptrs, num);
+}
+
+/* 
+*
+*  Another version of bf_malloc(Maintain an order linklist in , whose insert time complexity O(n))
+*
+*/
+
+static void * reuse_block_th(size_t size, Metadata * p, ThreadHeap *heap);
+static void * allocate_block_th(size_t size, ThreadHeap *heap);
+// static void* my_sbrk(size_t size);
+static void add_block_th(Metadata * p, ThreadHeap *heap);
+static void remove_block_th(Metadata * p, ThreadHeap *heap);
+static Metadata* coalesc_th(Metadata *p, ThreadHeap *heap);
+void bf_free_th(void * ptr, ThreadHeap *heap);
+
+// remove the block from the list and the size tree of heap, its size must be the one it is added with
+static void remove_block_th(Metadata * p, ThreadHeap *heap) {
+  stat_add(STAT_FREE_BLOCKS, -1);
+  heap->free_tree = tree_remove(heap->free_tree, p);
+  if(heap->first_free_block == p){
+    heap->first_free_block = p->next; // if p is last node, p->next = NULL
+    if(p == heap->last_free_block) heap->last_free_block = NULL;
+    if(p->next != NULL) p->next->prev = NULL;
+  }
+  else{
+    if(p->next!= NULL)p->next->prev = p->prev;
+    p->prev->next = p->next;
+    if(p == heap->last_free_block) heap->last_free_block = p->prev; 
+  }
+  p->next = NULL;
+  p->prev = NULL;
+}
+
+
+static void * reuse_block_th(size_t size, Metadata * p, ThreadHeap *heap) {
+  Metadata * remain = NULL;
+  if (GET_SIZE(p) >= size + TH_HEAD_SIZE + MIN_SIZE_TH) {
+    remain = (Metadata *)((char *)p + TH_HEAD_SIZE + size);
+    PUT(remain, PACK(GET_SIZE(p) - size - TH_HEAD_SIZE, UNALLOC));
+    remain->next = p->next;
+    if(p == heap->last_free_block){
+      heap->last_free_block = remain;
+    }else{
+      if(p->next) p->next->prev = remain;
+    }
+    p->next = remain;
+    remain->prev = p; // new added
+  }
+  remove_block_th(p, heap); // before the size of p changes
+  if(remain){
+    SET_SIZE(p, size);
+    heap->free_tree = tree_insert(heap->free_tree, remain);
+    stat_add(STAT_FREE_BLOCKS, 1);
+  }
+  stat_add(STAT_FREE, -(long)(GET_SIZE(p) + TH_HEAD_SIZE));
+  SET_FLAGS(p, ALLOC);
+  return (char *)p + HEAD_SIZE;
+}
+
+
+/*
+*
+*  Chunks of the version without lock: every heap carves its own chunks upwards from a region it
+*  reserves and bumps blocks from the current one, so growing takes no lock and the blocks of two
+*  heaps are never neighbours. A chunk carved right behind the current one grows it in place, so
+*  the region is one heap which only goes up as the break did, and a freed block is mostly added
+*  near the tail of the list ordered by address. A chunk is twice as long as the one before (up to
+*  CHUNK_MAX), a thread which mallocs a lot moves the top of its region rarely. When the region is
+*  full chunks are mapped one by one, the tail of the current chunk is freed as a block and a
+*  header of size 0 at the end of the chunk, which is never free, stops coalescing into the next.
+*  A free block reaching the top of the current chunk goes back to it.
+*
+*/
+
+// take a chunk for a block of need bytes (with its owner word) from the region, or map it
+static int new_chunk_th(ThreadHeap *heap, size_t need){
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t length = heap->chunk_size;
+  if(need > length - sizeof(Chunk) - TH_HEAD_SIZE){
+    length = (need + sizeof(Chunk) + TH_HEAD_SIZE + page - 1) / page * page;
+  }
+  if(heap->region == NULL){
+    heap->region = heap->region_top = reserve_region(HEAP_REGION, &heap->huge);
+  }
+  Chunk *old = heap->chunks, *c;
+  if(heap->region && length <= (size_t)(heap->region + HEAP_REGION - heap->region_top)){
+    c = heap->region_top;
+    heap->region_top += length;
+    heap->chunk_size = length * 2 < CHUNK_MAX ? length * 2 : CHUNK_MAX;
+    if(old && (void *)old + old->length == (void *)c){
+      old->length += length;
+      old->end += length;
+      heap->chunk_end += length;
+      return 1;
+    }
+  }else{
+    c = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    stat_add(STAT_MMAP_CALLS, 1);
+    if(c == MAP_FAILED) return 0;
+    heap->chunk_size = length * 2 < CHUNK_MAX ? length * 2 : CHUNK_MAX;
+  }
+  c->length = length;
+  c->end = (void *)c + length - HEAD_SIZE; // fresh memory reads as PACK(0, ALLOC)
+  void *tail = heap->chunk_top;
+  size_t remain = heap->chunk_end - tail;
+  c->next = old;
+  heap->chunks = c;
+  heap->chunk_top = (void *)c + sizeof(Chunk);
+  heap->chunk_end = (void *)c + length - TH_HEAD_SIZE;
+  heap->chunk_high = heap->chunk_top;
+  if(old == NULL) return 1;
+  if(remain < TH_HEAD_SIZE + MIN_SIZE_TH){
+    old->end = tail + sizeof(void *);
+    PUT(old->end, PACK(0, ALLOC));
+    return 1;
+  }
+  Metadata *p = tail + sizeof(void *);
+  PUT(p, PACK(remain - TH_HEAD_SIZE, ALLOC));
+  FRONT(p) = heap;
+  stat_add(STAT_HEAP, remain);
+  bf_free_th((char *)p + HEAD_SIZE, heap);
+  return 1;
+}
+
+// give a free block at the top of the current chunk back to it, return 0 if it is not there
+static int release_block_th(Metadata *p, ThreadHeap *heap){
+  if(NEXT_BLOCK_TH(p) != heap->chunk_top + sizeof(void *)) return 0;
+  size_t size = TH_HEAD_SIZE + GET_SIZE(p);
+  remove_block_th(p, heap);
+  heap->chunk_top = (void *)p - sizeof(void *);
+  stat_add(STAT_FREE, -(long)size);
+  stat_add(STAT_HEAP, -(long)size);
+  if((size_t)(heap->chunk_high - heap->chunk_top) >= atomic_load_explicit(&trim_threshold, memory_order_relaxed)){
+    trim_top_th(heap, TRIM_PAD);
+  }
+  return 1;
+}
+
+// extend the block ending at end by size bytes if it is the top of the current chunk
+static int grow_top_th(ThreadHeap *heap, void *end, size_t size){
+  void *top = end - sizeof(void *);
+  if(top != heap->chunk_top || size > (size_t)(heap->chunk_end - top)) return 0;
+  heap->chunk_top = top + size;
+  stat_add(STAT_HEAP, size);
+  if(heap->chunk_top > heap->chunk_high) heap->chunk_high = heap->chunk_top;
+  return 1;
+}
+
+// bump a block from the current chunk, a new chunk is mapped when it is full
+static void * allocate_block_th(size_t size, ThreadHeap *heap) {
+  size_t need = size + TH_HEAD_SIZE;
+  if(need > (size_t)(heap->chunk_end - heap->chunk_top) && !new_chunk_th(heap, need)){
+    return NULL;
+  }
+  void *res = heap->chunk_top;
+  heap->chunk_top = res + need;
+  stat_add(STAT_HEAP, need);
+  Metadata * new_block = res + sizeof(void *); // behind the owner word
+  PUT(new_block, PACK(size, ALLOC));
+  if(res >= heap->chunk_high){
+    heap->chunk_high = heap->chunk_top;
+    fresh_block_th = (void *)new_block + HEAD_SIZE;
+  }
+  return (void *)new_block + HEAD_SIZE;
+}
+
+// give the pages of the current chunk above its top back to os with madvise, keep pad bytes,
+// they read as zero again
+static size_t trim_top_th(ThreadHeap *heap, size_t pad){
+  if(heap->chunks == NULL) return 0;
+  size_t page = sysconf(_SC_PAGESIZE);
+  void *c = heap->chunks;
+  if(heap->huge && c >= heap->region && c < heap->region + HEAP_REGION) page = HUGE_PAGE; // given back whole
+  void *start = (void *)(((uintptr_t)heap->chunk_top + pad + page - 1) & ~(page - 1));
+  void *stop = (void *)(((uintptr_t)heap->chunk_high + page - 1) & ~(page - 1));
+  void *limit = (void *)((uintptr_t)heap->chunk_end & ~(page - 1)); // the page of the header at the end stays
+  if(stop > limit) stop = limit;
+  if(start >= stop) return 0;
+  madvise(start, stop - start, MADV_DONTNEED);
+  heap->chunk_high = start;
+  return stop - start;
+}
+
+// resize the block of current thread without moving it, the next block must be free in its own heap
+static int resize_block_th(Metadata *p, size_t size, ThreadHeap *heap){
+  size = align_th(size);
+  if(size > GET_SIZE(p)){
+    void *end = (void*)p + HEAD_SIZE + GET_SIZE(p);
+    if(grow_top_th(heap, end, size - GET_SIZE(p))){
+      SET_SIZE(p, size);
+      return 1;
+    }
+    // the memory above chunk_top holds no header, a free neighbour anywhere else is UNALLOC
+    Metadata *q = NEXT_BLOCK_TH(p);
+    if((void*)q == heap->chunk_top + sizeof(void *)) return 0;
+    if(GET_FLAGS(q) != UNALLOC || GET_SIZE(p) + TH_HEAD_SIZE + GET_SIZE(q) < size) return 0;
+    remove_block_th(q, heap);
+    stat_add(STAT_FREE, -(long)(TH_HEAD_SIZE + GET_SIZE(q)));
+    SET_SIZE(p, GET_SIZE(p) + TH_HEAD_SIZE + GET_SIZE(q));
+  }
+  // split the tail off as reuse_block_th does
+  if (GET_SIZE(p) >= size + TH_HEAD_SIZE + MIN_SIZE_TH) {
+    Metadata * remain = (Metadata *)((char *)p + TH_HEAD_SIZE + size);
+    PUT(remain, PACK(GET_SIZE(p) - size - TH_HEAD_SIZE, ALLOC));
+    SET_SIZE(p, size);
+    bf_free_th((char *)remain + HEAD_SIZE, heap);
+  }
+  return 1;
+}
+
+// link p into the list behind prev (at the head if prev is NULL) and into the size tree
+static void link_block_th(Metadata * p, Metadata * prev, ThreadHeap *heap) {
+  stat_add(STAT_FREE_BLOCKS, 1);
+  heap->free_tree = tree_insert(heap->free_tree, p);
+  p->prev = prev;
+  p->next = prev ? prev->next : heap->first_free_block;
+  if(p->next) p->next->prev = p;
+  else heap->last_free_block = p;
+  if(prev) prev->next = p;
+  else heap->first_free_block = p;
+}
+
+// different with verision 1 add block, it need to traverse to find its right positon
+static void add_block_th(Metadata * p, ThreadHeap *heap) {
+  Metadata *prev = NULL;
+  if(heap->first_free_block == NULL || p < heap->first_free_block){
+    prev = NULL;
+  }else if(p > heap->last_free_block){
+    prev = heap->last_free_block;
+  }else{
+    // walk from both ends at once, the list is long when blocks come back out of order
+    Metadata *next = heap->last_free_block;
+    prev = heap->first_free_block;
+    while(prev->next < p && next->prev > p){
+      prev = prev->next;
+      next = next->prev;
+    }
+    if(prev->next < p) prev = next->prev; // found from the tail
+  }
+  link_block_th(p, prev, heap);
+}
+
+
+static Metadata* coalesc_th(Metadata *p, ThreadHeap *heap){
+    if(!p) return NULL;
+    if(p->next && NEXT_BLOCK_TH(p) == (void*)(p->next)){
+      heap->free_tree = tree_remove(heap->free_tree, p); // before its size changes
+      Metadata *next = p->next;
+      remove_block_th(next, heap);
+      SET_SIZE(p, GET_SIZE(p) + TH_HEAD_SIZE + GET_SIZE(next));
+      heap->free_tree = tree_insert(heap->free_tree, p);
+    }
+    return p;
+}
+
+// coalesce the block just added to the list with its neighbours, return the block it ends in
+static Metadata * merge_block_th(Metadata *p, ThreadHeap *heap){
+  if(p != heap->last_free_block)coalesc_th(p, heap);
+  if(p != heap->first_free_block && NEXT_BLOCK_TH(p->prev) == (void*)p) p = coalesc_th(p->prev, heap);
+  return p;
+}
+
+void bf_free_th(void * ptr, ThreadHeap *heap) {
+  Metadata * p = (Metadata *)((char *)ptr - HEAD_SIZE);
+  SET_FLAGS(p, UNALLOC);
+  stat_add(STAT_FREE, GET_SIZE(p) + TH_HEAD_SIZE);
+  add_block_th(p, heap);
+  release_block_th(merge_block_th(p, heap), heap);
+}
+
+
+/*
+*
+*  Deferred coalescing without lock: a freed block waits in the quick list of its exact size and is
+*  given out again as it is, instead of coalescing it and splitting it again for the next malloc of
+*  the same size. Its header stays allocated, so its neighbours do not coalesce with it. The quick
+*  lists of a heap are coalesced all at once when a malloc finds no free block, or when they hold
+*  more than defer_limit bytes.
+*
+*/
+
+// sort a list of blocks linked by next by address (merge sort)
+static Metadata * sort_blocks_th(Metadata *list){
+  if(list == NULL || list->next == NULL) return list;
+  Metadata *slow = list, *fast = list->next;
+  while(fast && fast->next){
+    slow = slow->next;
+    fast = fast->next->next;
+  }
+  Metadata *half = slow->next;
+  slow->next = NULL;
+  Metadata *a = sort_blocks_th(list), *b = sort_blocks_th(half);
+  Metadata head, *tail = &head;
+  while(a && b){
+    Metadata **min = a < b ? &a : &b;
+    tail->next = *min;
+    tail = *min;
+    *min = (*min)->next;
+  }
+  tail->next = a ? a : b;
+  return head.next;
+}
+
+// coalesce every block of the quick lists of heap, return 0 if they are empty. They are freed by
+// address, so the walk for the place of every block in the list goes on from the one before it,
+// and the whole batch takes one pass over the list
+static int consolidate_th(ThreadHeap *heap){
+  if(heap->quick_size == 0) return 0;
+  Metadata *list = NULL;
+  for(int i = 0; i < QUICK_NUM; i++){
+    while(heap->quick[i]){
+      Metadata *p = heap->quick[i];
+      heap->quick[i] = p->next;
+      p->next = list;
+      list = p;
+    }
+  }
+  heap->quick_size = 0;
+  list = sort_blocks_th(list);
+  Metadata *prev = NULL; // free block in front of the last one freed
+  while(list){
+    Metadata *p = list;
+    list = p->next;
+    SET_FLAGS(p, UNALLOC);
+    stat_add(STAT_FREE, GET_SIZE(p) + TH_HEAD_SIZE);
+    if(heap->last_free_block && p > heap->last_free_block){
+      prev = heap->last_free_block;
+    }else if(prev == NULL && (heap->first_free_block == NULL || p < heap->first_free_block)){
+      prev = NULL;
+    }else{
+      if(prev == NULL) prev = heap->first_free_block;
+      while(prev->next && prev->next < p) prev = prev->next;
+    }
+    link_block_th(p, prev, heap);
+    p = merge_block_th(p, heap);
+    prev = p->prev;
+    if(!release_block_th(p, heap)) prev = p;
+  }
+  return 1;
+}
+
+// free a block of heap, with deferred coalescing a small one goes to its quick list
+static void free_block_th(Metadata *p, ThreadHeap *heap){
+  size_t limit = atomic_load_explicit(&defer_limit, memory_order_relaxed);
+  if(limit == 0 || GET_SIZE(p) > QUICK_MAX){
+    bf_free_th((char *)p + HEAD_SIZE, heap);
+    return;
+  }
+  Metadata **head = &heap->quick[GET_SIZE(p) / ALIGNMENT];
+  p->next = *head;
+  *head = p;
+  heap->quick_size += TH_HEAD_SIZE + GET_SIZE(p);
+  if(heap->quick_size > limit) consolidate_th(heap);
+}
+
+void * bf_malloc_th(size_t size, ThreadHeap *heap) {
+  if(size <= QUICK_MAX && heap->quick[size / ALIGNMENT]){
+    Metadata *p = heap->quick[size / ALIGNMENT];
+    heap->quick[size / ALIGNMENT] = p->next;
+    heap->quick_size -= TH_HEAD_SIZE + size;
+    return (char *)p + HEAD_SIZE;
+  }
+  Metadata * best = tree_best_fit(heap->free_tree, size);
+  // bumping from the current chunk is cheaper than coalescing, the quick lists wait until it is full
+  if(best == NULL && size + TH_HEAD_SIZE > (size_t)(heap->chunk_end - heap->chunk_top) && consolidate_th(heap)){
+    best = tree_best_fit(heap->free_tree, size);
+  }
+  if (best) {
+    return reuse_block_th(size, best,heap);
+  }
+  else {
+    return allocate_block_th(size, heap);
+  }
+}
+
+
+/*
+*
+*  Owner of blocks in the version without lock
+*
+*  Every allocated block records the heap it comes from. A block freed by another thread is pushed
+*  onto the remote_free stack of its owner (multi-producer, single consumer, lock free), and the
+*  owner takes the whole stack back on its next malloc, so a list only keeps its own blocks.
+*
+*/
+
+static pthread_key_t heap_key;
+static pthread_once_t heap_once = PTHREAD_ONCE_INIT;
+
+static void drain_remote_free(ThreadHeap *heap){
+  Metadata *p = atomic_exchange_explicit(&heap->remote_free, NULL, memory_order_acquire);
+  while(p){
+    Metadata *next = p->next;
+    free_block_th(p, heap);
+    p = next;
+  }
+}
+
+// keep the heap for next thread when the thread exits
+static void heap_destructor(void *arg){
+  ThreadHeap *heap = arg;
+  drain_remote_free(heap);
+  consolidate_th(heap);
+  lock_count(&mutex);
+  heap->next_abandoned = abandoned_heap;
+  abandoned_heap = heap;
+  pthread_mutex_unlock(&mutex);
+  heap_th = NULL;
+}
+
+static void heap_init(void){
+  pthread_key_create(&heap_key, heap_destructor);
+}
+
+// adopt a heap of an exited thread, or create a new one
+static ThreadHeap *get_heap_th(void){
+  if(heap_th) return heap_th;
+  pthread_once(&heap_once, heap_init);
+  lock_count(&mutex);
+  ThreadHeap *heap = abandoned_heap;
+  if(heap) abandoned_heap = heap->next_abandoned;
+  pthread_mutex_unlock(&mutex);
+  if(heap == NULL){
+    heap = my_sbrk_with_lock(sizeof(ThreadHeap));
+    if(heap == NULL) return NULL;
+    heap->first_free_block = NULL;
+    heap->last_free_block = NULL;
+    heap->free_tree = NULL;
+    atomic_init(&heap->remote_free, NULL);
+    heap->chunks = NULL;
+    heap->region = NULL;
+    heap->region_top = NULL;
+    heap->chunk_top = NULL;
+    heap->chunk_end = NULL;
+    heap->chunk_high = NULL;
+    heap->chunk_size = CHUNK_MIN;
+    memset(heap->quick, 0, sizeof(heap->quick));
+    heap->quick_size = 0;
+    heap->huge = 0;
+    heap->next_heap = atomic_load_explicit(&heap_list, memory_order_relaxed);
+    while(!atomic_compare_exchange_weak_explicit(&heap_list, &heap->next_heap, heap,
+                                                 memory_order_release, memory_order_relaxed));
+  }
+  heap->next_abandoned = NULL;
+  pthread_setspecific(heap_key, heap);
+  heap_th = heap;
+  return heap;
+}
+
+static void *malloc_nolock(size_t size){
+  if(is_mmap_size(size)) return mmap_block(size);
+  ThreadHeap *heap = get_heap_th();
+  if(heap == NULL) return NULL;
+  if(atomic_load_explicit(&heap->remote_free, memory_order_relaxed)){
+    drain_remote_free(heap);
+  }
+  void *ptr = bf_malloc_th(align_th(size), heap);
+  if(ptr){
+    FRONT(ptr - HEAD_SIZE) = heap;
+  }
+  return ptr;
+}
+static void free_nolock(void *ptr){
+  if(ptr == NULL) return;
+  Metadata *p = get_block(ptr);
+  ptr = (char *)p + HEAD_SIZE;
+  if(GET_FLAGS(p) == MMAPPED){
+    munmap_block(p);
+    return;
+  }
+  ThreadHeap *owner = FRONT(p);
+  if(owner == heap_th){
+    free_block_th(p, owner);
+    return;
+  }
+  Metadata *head = atomic_load_explicit(&owner->remote_free, memory_order_relaxed);
+  do{
+    p->next = head;
+  }while(!atomic_compare_exchange_weak_explicit(&owner->remote_free, &head, p,
+                                                memory_order_release, memory_order_relaxed));
+}
+static void *realloc_nolock(void *ptr, size_t size){
+  if(ptr && size){
+    Metadata *p = (Metadata *)((char *)ptr - HEAD_SIZE);
+    if(GET_FLAGS(p) == ALLOC && heap_th && FRONT(p) == heap_th &&
+       resize_block_th(p, size, heap_th)){
+      return ptr;
+    }
+  }
+  return realloc_block(ptr, size, malloc_nolock, free_nolock);
+}
+
+// the public functions of the version without lock record the trace and statistics
+void *ts_malloc_nolock(size_t size){
+  uint64_t start = stats_begin();
+  void *ptr = PROFILE_SAMPLE(size) ? profile_malloc(size) : malloc_nolock(size);
+  TRACE(TRACE_MALLOC, ptr, size);
+  stats_malloc(ptr, size, start);
+  return ptr;
+}
+void ts_free_nolock(void *ptr){
+  if(ptr == NULL) return;
+  uint64_t start = stats_begin();
+  size_t size = ts_malloc_usable_size(ptr);
+  TRACE(TRACE_FREE, ptr, 0);
+  PROFILE_FREE(ptr);
+  free_nolock(ptr);
+  stats_free(size, start);
+}
+// a checked alias of ts_free_nolock: the owner word next to the header has to be read anyway,
+// and a quick list takes the exact block size, so size is only checked in a debug build
+void ts_free_sized_nolock(void *ptr, size_t size){
+  if(ptr == NULL) return;
+  CHECK_SIZE(ptr, size);
+  (void)size;
+  ts_free_nolock(ptr);
+}
+void *ts_realloc_nolock(void *ptr, size_t size){
+  uint64_t start = stats_begin();
+  size_t old = ts_malloc_usable_size(ptr);
+  TRACE(TRACE_REALLOC_BEGIN, ptr, size);
+  if(ptr) PROFILE_FREE(ptr);
+  ptr = PROFILE_SAMPLE(size) ? profile_realloc(ptr, size, free_nolock) : realloc_nolock(ptr, size);
+  TRACE(TRACE_REALLOC_END, ptr, size);
+  stats_realloc(old, ptr, size, start);
+  return ptr;
+}
+void *ts_calloc_nolock(size_t num, size_t size){
+  uint64_t start = stats_begin();
+  void *ptr = calloc_block(num, size, PROFILE_SAMPLE(num * size) ? profile_malloc : malloc_nolock);
+  TRACE(TRACE_CALLOC, ptr, num * size);
+  stats_malloc(ptr, num * size, start);
+  return ptr;
+}
+void *ts_memalign_nolock(size_t alignment, size_t size){
+  uint64_t start = stats_begin();
+  void *ptr = memalign_block(alignment, size, PROFILE_SAMPLE(size) ? profile_malloc : malloc_nolock);
+  TRACE(TRACE_MEMALIGN, ptr, size);
+  stats_malloc(ptr, size, start);
+  return ptr;
+}
+// the quick lists of current thread are coalesced when it is turned off, those of other threads
+// on their next malloc which finds no free block
+void ts_set_defer_coalescing(size_t limit){
+  atomic_store_explicit(&defer_limit, limit, memory_order_relaxed);
+  if(limit == 0 && heap_th) consolidate_th(heap_th);
+}
+
+// usable size of a block from both versions
+size_t ts_malloc_usable_size(void *ptr){
+  if(ptr == NULL) return 0;
+  return GET_ATOMIC((char *)ptr - HEAD_SIZE) & ~FLAGS;
+}
+
+// trim the top of heap until only pad bytes left, return 1 if any memory is released
+// the blocks cached by current thread and the class stacks are flushed first, for the version without lock only
+// the heap of current thread is trimmed after its quick lists are coalesced
+int my_malloc_trim(size_t pad) {
+  size_t release = 0;
+  if(cache_registered){
+    for(int i = 0; i < CACHE_BIN_NUM; i++){
+      if(cache_th.count[i]) cache_flush(&cache_th, i, 0);
+    }
+  }
+  stack_drain();
+  for(int i = 0; i < arena_num; i++){
+    Arena *a = &arenas[i];
+    lock_count(&a->lock);
+    if(a->top_prev_free){
+      void *tail = a->top - TAIL_SIZE;
+      release += trim_top_lock(a, (Metadata *)(a->top - GET_SIZE(tail) - HEAD_SIZE), pad);
+    }
+    pthread_mutex_unlock(&a->lock);
+  }
+  if(heap_th){
+    consolidate_th(heap_th);
+    release += trim_top_th(heap_th, pad);
+  }
+  return release > 0;
+}
+
+/*
+*
+*  Fork: hold all locks across fork, so the child never gets a lock held by a thread
+*  which does not exist in it
+*
+*/
+
+static void prefork(void){
+  pthread_mutex_lock(&trace_lock);
+  for(int i = 0; i < arena_num; i++){
+    pthread_mutex_lock(&arenas[i].lock);
+  }
+  pthread_mutex_lock(&mutex);
+  pthread_mutex_lock(&stats_lock);
+#ifndef MY_MALLOC_NO_PROFILE
+  pthread_mutex_lock(&profile_lock);
+#endif
+}
+
+static void postfork_parent(void){
+#ifndef MY_MALLOC_NO_PROFILE
+  pthread_mutex_unlock(&profile_lock);
+#endif
+  pthread_mutex_unlock(&stats_lock);
+  pthread_mutex_unlock(&mutex);
+  for(int i = 0; i < arena_num; i++){
+    pthread_mutex_unlock(&arenas[i].lock);
+  }
+  pthread_mutex_unlock(&trace_lock);
+}
+
+// the child does not write to the trace of its parent
+static void postfork_child(void){
+#ifndef MY_MALLOC_NO_PROFILE
+  pthread_mutex_init(&profile_lock, NULL);
+#endif
+  pthread_mutex_init(&stats_lock, NULL);
+  pthread_mutex_init(&mutex, NULL);
+  for(int i = 0; i < arena_num; i++){
+    pthread_mutex_init(&arenas[i].lock, NULL);
+  }
+  pthread_mutex_init(&trace_lock, NULL);
+  atomic_store(&stack_readers, 0); // pops of other threads never end in the child
+  atomic_store(&trace_on, 0);
+  if(trace_fd >= 0) close(trace_fd);
+  trace_fd = -1;
+}
+
+// create the thread keys early, so pthread_setspecific never allocates for them,
+// and start the trace if MY_MALLOC_TRACE is set
+__attribute__((constructor)) static void my_malloc_init(void){
+  pthread_once(&cache_once, cache_init);
+  pthread_once(&heap_once, heap_init);
+  pthread_once(&stats_once, stats_init);
+  pthread_key_create(&trace_key, trace_destructor);
+  pthread_atfork(prefork, postfork_parent, postfork_child);
+  const char *latency = getenv("MY_MALLOC_LATENCY");
+  if(latency != NULL && atoi(latency)) my_malloc_stats_latency(1);
+  const char *huge = getenv("MY_MALLOC_HUGEPAGE");
+  if(huge != NULL && atoi(huge)) ts_set_huge_pages(1);
+  const char *defer = getenv("MY_MALLOC_DEFER");
+  if(defer != NULL) ts_set_defer_coalescing(strtoul(defer, NULL, 10));
+  const char *path = getenv("MY_MALLOC_TRACE");
+  if(path != NULL && my_malloc_trace_start(path) == 0){
+    atexit(my_malloc_trace_stop);
+  }
+#ifndef MY_MALLOC_NO_PROFILE
+  profile_path = getenv("MY_MALLOC_PROFILE");
+  if(profile_path != NULL){
+    const char *rate = getenv("MY_MALLOC_PROFILE_RATE");
+    my_malloc_profile_start(rate ? strtoul(rate, NULL, 10) : 0);
+    atexit(profile_write);
+  }
+#endif
 }
-void ts_free_nolock(void *ptr){
-  bf_free_th(ptr, &first_free_block_th, &last_free_block_th);
-  // bf_free(ptr, With_sbk_lock, &first_free_block_th, &last_free_block_th);
-}
\ No newline at end of file
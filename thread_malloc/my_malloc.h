@@ -8,9 +8,107 @@
 //Thread Safe malloc/free: locking version 
 void *ts_malloc_lock(size_t size); 
 void ts_free_lock(void *ptr);
+// max number of cached blocks per thread for the size class of size (<= 512), 0 disables the cache
+int ts_set_cache_limit(size_t size, unsigned int limit);
+// number of arenas (<= 64) of locking version, only before its first malloc, return -1 if it cannot be set
+// MY_MALLOC_ARENAS=num sets it as well, default is 4 arenas per cpu
+int ts_set_arena_num(unsigned int num);
+// back the arenas and the heaps without lock by transparent huge pages: regions aligned to 2 MB and advised
+// MADV_HUGEPAGE, every thread of the lock version mallocs from one and arena 0 on sbrk is only the fallback.
+// Call it before the first malloc (after ts_set_arena_num), heaps without lock made later follow it anyway.
+// MY_MALLOC_HUGEPAGE=1 sets it, return -1 if the kernel has no transparent huge pages or the arenas are set
+int ts_set_huge_pages(int on);
+// free with the size given to malloc (C23 free_sized), a block up to 512 bytes goes to the thread cache
+// by size, -DMY_MALLOC_DEBUG aborts if size does not match the block
+void ts_free_sized_lock(void *ptr, size_t size);
+
+// malloc num blocks of size with one lock, carved from one free block or one extension of the heap,
+// return how many are malloced into ptrs
+size_t my_malloc_batch(size_t size, size_t num, void **ptrs);
+// free num blocks of the lock version (NULL is skipped), sorted by address so neighbours are
+// coalesced in one pass with one lock of every arena, the order of ptrs is changed
+void my_free_batch(void **ptrs, size_t num);
 
 //Thread Safe malloc/free: non-locking version 
 void *ts_malloc_nolock(size_t size); 
 void ts_free_nolock(void *ptr);
+void ts_free_sized_nolock(void *ptr, size_t size);
+// deferred coalescing: a freed block up to 1024 bytes waits in a list of its exact size for the next malloc
+// of it, the lists of a thread are coalesced when a malloc finds no free block or more than limit bytes
+// wait, 0 turns it off (default). MY_MALLOC_DEFER=limit sets it when the library is loaded
+void ts_set_defer_coalescing(size_t limit);
+
+// realloc grows / shrinks the block in place when possible, large block in its own mapping grows with mremap
+// calloc only zeroes memory not fresh from os
+void *ts_realloc_lock(void *ptr, size_t size);
+void *ts_realloc_nolock(void *ptr, size_t size);
+void *ts_calloc_lock(size_t num, size_t size);
+void *ts_calloc_nolock(size_t num, size_t size);
+
+// alignment is a power of two, a header tagged ALIGNED in front of the pointer leads free to the real block
+void *ts_memalign_lock(size_t alignment, size_t size);
+void *ts_memalign_nolock(size_t alignment, size_t size);
+size_t ts_malloc_usable_size(void *ptr);
+
+unsigned long get_data_segment_size(); //in bytes
+unsigned long get_data_segment_free_space_size(); //in bytes
+
+// give the free space at the top of heap back to os until pad bytes left, return 1 if memory released
+int my_malloc_trim(size_t pad);
+// a free block at the top of heap larger than threshold is trimmed when free
+void set_trim_threshold(size_t threshold);
+
+// record malloc / free / realloc of all threads to path (format in my_malloc_trace.h),
+// MY_MALLOC_TRACE=path starts it when the library is loaded, return -1 if it cannot start
+int my_malloc_trace_start(const char *path);
+void my_malloc_trace_stop(void);
+
+// malloc size >= threshold is served by its own mmap mapping
+void set_mmap_threshold(size_t threshold);
+unsigned long get_mmap_threshold(); //in bytes
+unsigned long get_mmap_block_num(); //mapped blocks in use
+unsigned long get_mmap_size(); //in bytes
+
+// statistics of both versions, every thread counts on its own and they are summed when read
+#define MY_MALLOC_CLASS_NUM 33 // class i counts mallocs of (16 i, 16 (i + 1)] bytes, the last one larger than 512
+#define MY_MALLOC_LATENCY_NUM 32 // latency bucket i counts calls of [2^i, 2^(i+1)) ns
+enum {MY_MALLOC_OP_MALLOC, MY_MALLOC_OP_FREE, MY_MALLOC_OP_REALLOC, MY_MALLOC_OP_NUM};
+
+typedef struct {
+  unsigned long mapped_bytes; // heap_bytes + mmap_bytes
+  unsigned long heap_bytes; // data segment, arena regions and chunks without lock, get_data_segment_size()
+  unsigned long mmap_bytes; // blocks in their own mapping
+  unsigned long mmap_blocks;
+  unsigned long in_use_bytes; // usable size of the blocks the program holds
+  unsigned long free_bytes; // blocks in free lists, the rest of heap is headers, thread caches and quick lists
+  unsigned long free_blocks; // length of all free lists
+  unsigned long malloc_calls; // malloc, calloc and memalign
+  unsigned long free_calls;
+  unsigned long realloc_calls;
+  unsigned long sbrk_calls;
+  unsigned long mmap_calls; // mmap and mremap
+  unsigned long munmap_calls;
+  unsigned long lock_acquisitions; // arena locks and the sbrk mutex
+  unsigned long lock_contended; // acquisitions which waited for another thread
+  unsigned long class_mallocs[MY_MALLOC_CLASS_NUM];
+  unsigned long latency[MY_MALLOC_OP_NUM][MY_MALLOC_LATENCY_NUM]; // only while latency is on
+} MallocStats;
+
+void my_malloc_stats(MallocStats *stats);
+// write the statistics as one line of JSON (json != 0) or one "name value" line each, -1 on error
+int my_malloc_stats_print(FILE *out, int json);
+// time every call into the latency histogram, MY_MALLOC_LATENCY=1 turns it on when the library is loaded
+void my_malloc_stats_latency(int on);
+// heap backed by transparent huge pages (AnonHugePages of the arena and heap regions), not one of the
+// statistics since it parses /proc/self/smaps
+unsigned long my_malloc_huge_bytes(void);
+
+// sample about one malloc every rate bytes (0 for 512 KB) with its stack, samples live until they are freed,
+// MY_MALLOC_PROFILE=path starts it when the library is loaded and writes a pprof profile to path at exit
+// (MY_MALLOC_PROFILE_RATE=bytes), return -1 if built with -DMY_MALLOC_NO_PROFILE
+int my_malloc_profile_start(size_t rate);
+void my_malloc_profile_stop(void);
+// write the live samples by stack, as a pprof heap profile (pprof != 0) or as text, -1 on error
+int my_malloc_profile_dump(FILE *out, int pprof);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,38 @@
+#include <new>
+#include <cstddef>
+/**
+ * @brief sized operator delete of C++14 / C++17, linked into libmymalloc_preload.so
+ *
+ * operator new of libstdc++ calls malloc / aligned_alloc, which are the preloaded ones, a delete
+ * which knows the size (g++ -fsized-deallocation, on by default since C++14) reaches free_sized.
+ * A delete without the size goes to free. Only the header <new> is used, so the library does
+ * not depend on libstdc++.
+ */
+
+extern "C" void free(void *ptr) noexcept;
+extern "C" void free_sized(void *ptr, std::size_t size);
+extern "C" void free_aligned_sized(void *ptr, std::size_t alignment, std::size_t size);
+
+void operator delete(void *ptr) noexcept {
+  free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+  free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t size) noexcept {
+  free_sized(ptr, size);
+}
+
+void operator delete[](void *ptr, std::size_t size) noexcept {
+  free_sized(ptr, size);
+}
+
+void operator delete(void *ptr, std::size_t size, std::align_val_t alignment) noexcept {
+  free_aligned_sized(ptr, static_cast<std::size_t>(alignment), size);
+}
+
+void operator delete[](void *ptr, std::size_t size, std::align_val_t alignment) noexcept {
+  free_aligned_sized(ptr, static_cast<std::size_t>(alignment), size);
+}
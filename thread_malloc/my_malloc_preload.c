@@ -0,0 +1,210 @@
+#define _GNU_SOURCE
+#include "my_malloc.h"
+#include <errno.h>
+#include <malloc.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+/**
+ * @brief drop-in replacement of the libc malloc family, built as libmymalloc_preload.so
+ *
+ *   LD_PRELOAD=./libmymalloc_preload.so ./program
+ *   LD_PRELOAD=./libmymalloc_preload.so MY_MALLOC=nolock ./program
+ *
+ * MY_MALLOC picks the version (lock by default) at the first call, it never changes later,
+ * since a block must be freed by the version which allocated it.
+ *
+ * libc may call malloc again while the allocator is running (e.g. the first pthread call of
+ * a thread), those nested calls and the ones before the version is known are served from a
+ * static bootstrap buffer, whose blocks are never reused.
+ */
+
+#define BOOTSTRAP_SIZE (64 * 1024)
+#define BOOTSTRAP_ALIGN 16 // the size of a block is kept in the 16 bytes before it
+
+static char bootstrap[BOOTSTRAP_SIZE] __attribute__((aligned(BOOTSTRAP_ALIGN)));
+static atomic_size_t bootstrap_used = 0;
+static __thread int in_malloc = 0; // set while this thread runs the allocator
+static int variant = -1; // 0: lock, 1: nolock, -1: not chosen yet
+
+static int is_nolock(void){
+  if(variant < 0){
+    const char *env = getenv("MY_MALLOC");
+    variant = env != NULL && strcmp(env, "nolock") == 0;
+  }
+  return variant;
+}
+
+static int is_bootstrap(void *ptr){
+  return (char *)ptr >= bootstrap && (char *)ptr < bootstrap + BOOTSTRAP_SIZE;
+}
+
+// bump allocation from the bootstrap buffer, the memory is zero and never reused
+static void *bootstrap_malloc(size_t alignment, size_t size){
+  if(alignment < BOOTSTRAP_ALIGN) alignment = BOOTSTRAP_ALIGN;
+  if(size > BOOTSTRAP_SIZE) return NULL;
+  size_t need = (size + BOOTSTRAP_ALIGN + alignment - 1) / BOOTSTRAP_ALIGN * BOOTSTRAP_ALIGN;
+  size_t offset = atomic_fetch_add(&bootstrap_used, need);
+  if(offset + need > BOOTSTRAP_SIZE) return NULL;
+  uintptr_t ptr = (uintptr_t)(bootstrap + offset + BOOTSTRAP_ALIGN);
+  ptr = (ptr + alignment - 1) & ~(uintptr_t)(alignment - 1);
+  *(size_t *)(ptr - BOOTSTRAP_ALIGN) = size;
+  return (void *)ptr;
+}
+
+static size_t bootstrap_size(void *ptr){
+  return *(size_t *)((char *)ptr - BOOTSTRAP_ALIGN);
+}
+
+// smallest power of two >= alignment, as glibc memalign
+static size_t round_alignment(size_t alignment){
+  size_t res = 1;
+  while(res < alignment) res <<= 1;
+  return res;
+}
+
+static void *memalign_impl(size_t alignment, size_t size){
+  void *res;
+  if(in_malloc) return bootstrap_malloc(alignment, size);
+  in_malloc = 1;
+  res = is_nolock() ? ts_memalign_nolock(alignment, size) : ts_memalign_lock(alignment, size);
+  in_malloc = 0;
+  if(res == NULL) errno = ENOMEM;
+  return res;
+}
+
+void *malloc(size_t size){
+  void *res;
+  if(in_malloc) return bootstrap_malloc(0, size);
+  in_malloc = 1;
+  res = is_nolock() ? ts_malloc_nolock(size) : ts_malloc_lock(size);
+  in_malloc = 0;
+  if(res == NULL) errno = ENOMEM;
+  return res;
+}
+
+void free(void *ptr){
+  if(ptr == NULL || is_bootstrap(ptr)) return;
+  int nested = in_malloc;
+  in_malloc = 1;
+  if(is_nolock()){
+    ts_free_nolock(ptr);
+  }else{
+    ts_free_lock(ptr);
+  }
+  in_malloc = nested;
+}
+
+// C23 sized free, size (and alignment) are those given to malloc / aligned_alloc
+void free_sized(void *ptr, size_t size){
+  if(ptr == NULL || is_bootstrap(ptr)) return;
+  int nested = in_malloc;
+  in_malloc = 1;
+  if(is_nolock()){
+    ts_free_sized_nolock(ptr, size);
+  }else{
+    ts_free_sized_lock(ptr, size);
+  }
+  in_malloc = nested;
+}
+
+void free_aligned_sized(void *ptr, size_t alignment, size_t size){
+  (void)alignment; // the header in front of an aligned pointer finds the block
+  free_sized(ptr, size);
+}
+
+void *calloc(size_t num, size_t size){
+  void *res;
+  if(size != 0 && num > SIZE_MAX / size){
+    errno = ENOMEM;
+    return NULL;
+  }
+  if(in_malloc) return bootstrap_malloc(0, num * size);
+  in_malloc = 1;
+  res = is_nolock() ? ts_calloc_nolock(num, size) : ts_calloc_lock(num, size);
+  in_malloc = 0;
+  if(res == NULL) errno = ENOMEM;
+  return res;
+}
+
+void *realloc(void *ptr, size_t size){
+  void *res;
+  if(ptr != NULL && is_bootstrap(ptr)){
+    // move out of the bootstrap buffer
+    size_t old_size = bootstrap_size(ptr);
+    if(size == 0) return NULL;
+    res = malloc(size);
+    if(res != NULL) memcpy(res, ptr, old_size < size ? old_size : size);
+    return res;
+  }
+  if(in_malloc){
+    if(ptr == NULL) return bootstrap_malloc(0, size);
+    errno = ENOMEM;
+    return NULL;
+  }
+  in_malloc = 1;
+  res = is_nolock() ? ts_realloc_nolock(ptr, size) : ts_realloc_lock(ptr, size);
+  in_malloc = 0;
+  if(res == NULL && size != 0) errno = ENOMEM;
+  return res;
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size){
+  if(alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0) return EINVAL;
+  void *res = memalign_impl(alignment, size);
+  if(res == NULL) return ENOMEM;
+  *memptr = res;
+  return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size){
+  if(alignment == 0 || (alignment & (alignment - 1)) != 0){
+    errno = EINVAL;
+    return NULL;
+  }
+  return memalign_impl(alignment, size);
+}
+
+void *memalign(size_t alignment, size_t size){
+  return memalign_impl(round_alignment(alignment), size);
+}
+
+void *valloc(size_t size){
+  return memalign_impl(sysconf(_SC_PAGESIZE), size);
+}
+
+void *pvalloc(size_t size){
+  size_t page = sysconf(_SC_PAGESIZE);
+  if(size > SIZE_MAX - page){
+    errno = ENOMEM;
+    return NULL;
+  }
+  return memalign_impl(page, (size + page - 1) / page * page);
+}
+
+size_t malloc_usable_size(void *ptr){
+  if(ptr == NULL) return 0;
+  if(is_bootstrap(ptr)) return bootstrap_size(ptr);
+  return ts_malloc_usable_size(ptr);
+}
+
+struct mallinfo2 mallinfo2(void){
+  struct mallinfo2 info;
+  memset(&info, 0, sizeof(info));
+  info.arena = get_data_segment_size();
+  info.fordblks = get_data_segment_free_space_size();
+  info.uordblks = info.arena - info.fordblks;
+  info.hblks = get_mmap_block_num();
+  info.hblkhd = get_mmap_size();
+  return info;
+}
+
+int malloc_trim(size_t pad){
+  int res;
+  int nested = in_malloc;
+  in_malloc = 1;
+  res = my_malloc_trim(pad);
+  in_malloc = nested;
+  return res;
+}
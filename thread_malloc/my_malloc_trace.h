@@ -0,0 +1,42 @@
+#ifndef __MY_MALLOC_TRACE__
+#define __MY_MALLOC_TRACE__
+#include <stdint.h>
+/**
+ * @brief binary trace written by my_malloc_trace_start (or MY_MALLOC_TRACE=path)
+ *
+ * | TraceHeader | TraceEvent | TraceEvent | ...
+ *
+ * Every thread fills its own buffer and writes it as a whole, so events are in time order
+ * inside a thread only. ptr is the address seen by the program, the replay tool sorts the
+ * events by time and gives every object a stable id from it.
+ *
+ * realloc is written as two events of the same thread: TRACE_REALLOC_BEGIN (old ptr, new size)
+ * when it starts and TRACE_REALLOC_END (new ptr, new size) when it returns, so the old
+ * address is never seen alive after another thread gets it back from malloc.
+ */
+
+#define TRACE_MAGIC 0x45434152544d4d59ull // "YMMTRACE"
+#define TRACE_VERSION 1
+
+#define TRACE_MALLOC 1
+#define TRACE_FREE 2
+#define TRACE_CALLOC 3 // size is num * size
+#define TRACE_MEMALIGN 4
+#define TRACE_REALLOC_BEGIN 5
+#define TRACE_REALLOC_END 6
+
+typedef struct {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t event_size; // sizeof(TraceEvent)
+} TraceHeader;
+
+typedef struct {
+  uint64_t time; // ns from the start of the trace
+  uint64_t ptr;
+  uint64_t size;
+  uint32_t thread; // index of the thread in the trace
+  uint32_t op;
+} TraceEvent;
+
+#endif